@@ -8,6 +8,7 @@
 #include <ctime>
 #include <chrono>
 #include <functional>
+#include <memory>
 #include <omp.h>
 
 //Own includes
@@ -15,9 +16,17 @@
 #include "map/include/base_types.hpp"
 #include "map/include/parseCmdArgs.hpp"
 #include "map/include/winSketch.hpp"
+#include "map/include/querySketch.hpp"
 #include "map/include/computeMap.hpp"
 #include "map/include/commonFunc.hpp"
+#include "map/include/refIndex.hpp"
 #include "cgi/include/computeCoreIdentity.hpp" 
+#include "cgi/include/checkpoint.hpp"
+#include "cgi/include/mergeShards.hpp"
+#include "cgi/include/resultWriter.hpp"
+#include "cgi/include/binaryResults.hpp"
+#include "cgi/include/prefilter.hpp"
+#include "cgi/include/queryServer.hpp"
 
 int main(int argc, char** argv)
 {
@@ -28,91 +37,412 @@ int main(int argc, char** argv)
   unsetenv((char *)"MALLOC_ARENA_MAX");
   using namespace std::placeholders;  // for _1, _2, _3...
 
+  //sketching and mapping parameters
+  skch::Parameters parameters;
+
+  //'fastANI index' sketches the reference genomes and saves them for later runs
+  if (argc > 1 && std::string(argv[1]) == "index")
+  {
+    skch::parseandSaveIndex(argc - 1, argv + 1, parameters);
+
+    omp_set_num_threads( parameters.threads ); 
+
+    //Reference genomes are saved in contiguous blocks, boundaries are kept in the index
+    std::vector <uint64_t> refGenomeBegin;
+    cgi::partitionReferenceGenomes (parameters, cgi::referenceBlockCount(parameters), refGenomeBegin);
+
+    std::vector <skch::Parameters> parameters_split;
+    cgi::splitReferenceGenomes (parameters, refGenomeBegin, parameters_split);
+
+    skch::RefIndex::build(parameters, parameters_split, refGenomeBegin);
+    return 0;
+  }
+
+  //'fastANI merge' combines the outputs of the shards of a run
+  if (argc > 1 && std::string(argv[1]) == "merge")
+  {
+    std::vector<std::string> shardFiles;
+    skch::parseandSaveMerge(argc - 1, argv + 1, parameters, shardFiles);
+
+    cgi::mergeShards(parameters, shardFiles);
+    return 0;
+  }
+
+  //'fastANI convert' writes a binary output in text format
+  if (argc > 1 && std::string(argv[1]) == "convert")
+  {
+    std::string binaryFile, outFileName;
+    skch::parseandSaveConvert(argc - 1, argv + 1, binaryFile, outFileName);
+
+    cgi::BinaryResults::convertToText(binaryFile, outFileName);
+    return 0;
+  }
+
+  //'fastANI serve' keeps a reference index loaded, and maps query genomes sent by clients
+  if (argc > 1 && std::string(argv[1]) == "serve")
+  {
+    std::string socketPath;
+    skch::parseandSaveServe(argc - 1, argv + 1, parameters, socketPath);
+
+    cgi::QueryServer server(parameters, socketPath);
+    server.run();
+    return 0;
+  }
+
+  //'fastANI client' sends query genomes to a running 'fastANI serve'
+  if (argc > 1 && std::string(argv[1]) == "client")
+  {
+    std::string socketPath;
+    bool upload;
+    skch::parseandSaveClient(argc - 1, argv + 1, parameters, socketPath, upload);
+
+    cgi::queryServer(socketPath, parameters.querySequences, upload, parameters.outFileName);
+    return 0;
+  }
+
   //Parse command line arguements   
-  skch::Parameters parameters;        //sketching and mapping parameters
   skch::parseandSave(argc, argv, parameters);
 
+  //Mappings go to an in-memory result sink, file name is used for CGI output only
   std::string fileName = parameters.outFileName;
 
-  //To redirect Mashmap's mapping output to null fs, using file name for CGI output
-  parameters.outFileName = "/dev/null";
+  //A shard computes its range of query genomes against its range of reference genomes
+  cgi::Shard shard;
+  if (parameters.shardCount > 0)
+    cgi::selectShard(parameters, shard);
+
+  //Reference genomes are split into contiguous blocks, either sketched here 
+  //or loaded from the blocks saved in the reference index
+  skch::RefIndex::MappedFile refIndexFile;
+  std::vector <uint64_t> refGenomeBegin;
+
+  if (parameters.refIndex != "")
+  {
+    refIndexFile.open(parameters.refIndex, parameters.refSequences.size());
+    refIndexFile.getPartitionGenomeBegin(refGenomeBegin);
+  }
+  else
+    cgi::partitionReferenceGenomes (parameters, cgi::referenceBlockCount(parameters), refGenomeBegin);
+
+  //Completed (query genome, reference block) pairs are saved as they complete. 
+  //A resumed run takes the block boundaries of the saved run
+  std::unique_ptr<cgi::Checkpoint> checkpoint;
+  if (parameters.checkpointDir != "")
+  {
+    checkpoint.reset(new cgi::Checkpoint());
+    checkpoint->open(parameters, refGenomeBegin);
+  }
 
   //Set up for parallel execution
   omp_set_num_threads( parameters.threads ); 
-  std::vector <skch::Parameters> parameters_split (parameters.threads);
-  cgi::splitReferenceGenomes (parameters, parameters_split);
+  std::vector <skch::Parameters> parameters_split;
+  cgi::splitReferenceGenomes (parameters, refGenomeBegin, parameters_split);
+
+  uint64_t blockCount = parameters_split.size();
+
+  std::cerr << "INFO, skch::main, " << parameters.querySequences.size() << " query genomes are mapped against "
+    << blockCount << " blocks of " << parameters.refSequences.size() << " reference genomes" << std::endl;
+
+  //Total file size of each block, to estimate the cost of tiles
+  std::vector <uint64_t> refBlockSizes (blockCount);
+  for (uint64_t b = 0; b < blockCount; b++)
+    refBlockSizes[b] = skch::CommonFunc::getReferenceSize(parameters_split[b].refSequences);
+
+  //Mapping statistics, filled on demand by all threads
+  skch::Stat::MappingTable statTable(parameters.kmerSize, parameters.percentageIdentity, parameters.minReadLength);
+
+  //Results are written per query genome as it completes, shards report genome ids for merging
+  std::unique_ptr<cgi::ResultWriter> writer;
 
-  //Final output vector of ANI computation
-  std::vector<cgi::CGI_Results> finalResults;
+  //Query genome lengths are recorded while sketching
+  std::vector <uint64_t> queryGenomeLengths (parameters.querySequences.size());
 
-#pragma omp parallel for schedule(static,1)
-  for (uint64_t i = 0; i < parameters.threads; i++)
+  //Query genomes are sketched once per batch, and shared by all threads
+  std::vector < std::pair<uint64_t, uint64_t> > queryBatches;
+  cgi::splitQueryGenomes (parameters, queryBatches);
+
+  std::vector <skch::QuerySketch> querySketches;
+
+  //Sketches of reference blocks
+  std::vector < std::unique_ptr<skch::Sketch> > referSketches (blockCount);
+
+  //Genomes are read and decompressed on dedicated threads, ahead of the sketching threads
+  std::unique_ptr<skch::GenomeReader> refReader;
+  if (parameters.refIndex == "")
+    refReader.reset( new skch::GenomeReader(parameters.refSequences, 
+          skch::GenomeReader::threadCount(parameters.threads), skch::GenomeReader::defaultBufferSize) );
+
+  skch::GenomeReader queryReader (parameters.querySequences, 
+      skch::GenomeReader::threadCount(parameters.threads), skch::GenomeReader::defaultBufferSize);
+
+  //Work is split into (query genome, reference block, fragment range) tiles, idle threads 
+  //pick up the remaining tiles in decreasing order of their estimated cost
+  std::vector <cgi::Tile> tiles;
+
+  //Per (query genome, reference block) pair, saved at (query genome - batch begin) * blockCount + block:
+  //mappings of each fragment range, count of ranges not mapped yet, and results
+  std::vector < std::vector<skch::MappingResultsVector_t> > pairMappings;
+  std::vector <uint64_t> pendingRanges;
+  std::vector < std::vector<cgi::CGI_Results> > pairResults;
+
+  //Per query genome of a batch, count of reference blocks not done yet
+  std::vector <uint64_t> pendingBlocks;
+
+  //Optional prefilter, per (query genome, reference block) pair: genomes of the block 
+  //left to map against, all if empty
+  cgi::Prefilter prefilter;
+  std::vector <cgi::Prefilter::QueryGenome> queryGenomes;
+  std::vector < std::vector<bool> > pairGenomes;
+  uint64_t prefilterPairs = 0, prefilterSkippedPairs = 0, prefilterTiles = 0, prefilterSkippedTiles = 0;
+
+#pragma omp parallel
   {
-    if ( omp_get_thread_num() == 0)
+    int tid = omp_get_thread_num();
+
+    if ( tid == 0)
       std::cerr << "INFO [thread 0], skch::main, Count of threads executing parallel_for : " << omp_get_num_threads() << std::endl;
 
     //start timer
     auto t0 = skch::Time::now();
 
-    //Build the sketch for reference
-    skch::Sketch referSketch(parameters_split[i]);
+    //Build the sketch for reference blocks, or load it from the index
+#pragma omp for schedule(dynamic, 1)
+    for (uint64_t b = 0; b < blockCount; b++)
+    {
+      if (parameters.refIndex != "")
+        referSketches[b].reset( new skch::Sketch(refIndexFile.loadPartition(parameters_split[b], b)) );
+      else
+        referSketches[b].reset( new skch::Sketch(parameters_split[b], refReader.get(), refGenomeBegin[b]) );
+    }
+
+    //All reference genomes are read, stop the reader threads. 
+    //Genome lengths are recorded while sketching (or saved in the reference index)
+#pragma omp single
+    {
+      refReader.reset();
+
+      std::vector <uint64_t> refGenomeLengths (parameters.refSequences.size());
+      for (uint64_t b = 0; b < blockCount; b++)
+        for (uint64_t j = 0; j < parameters_split[b].refSequences.size(); j++)
+          refGenomeLengths[refGenomeBegin[b] + j] = referSketches[b]->genomeLengths[j];
+
+      writer.reset( new cgi::ResultWriter(parameters, refGenomeLengths, 
+            parameters.shardCount > 0 ? &shard : nullptr, fileName) );
+    }
 
     std::chrono::duration<double> timeRefSketch = skch::Time::now() - t0;
 
-    if ( omp_get_thread_num() == 0)
+    if ( tid == 0)
       std::cerr << "INFO [thread 0], skch::main, Time spent sketching the reference : " << timeRefSketch.count() << " sec" << std::endl;
 
-    //Final output vector of ANI computation
-    std::vector<cgi::CGI_Results> finalResults_local;
-
-    //Loop over query genomes
-    for(uint64_t queryno = 0; queryno < parameters_split[i].querySequences.size(); queryno++)
+    for (auto &batch : queryBatches)
     {
       t0 = skch::Time::now();
 
-      skch::MappingResultsVector_t mapResults;
-      uint64_t totalQueryFragments = 0;
+      uint64_t pairCount = (batch.second - batch.first) * blockCount;
 
-      auto fn = std::bind(skch::Map::insertL2ResultsToVec, std::ref(mapResults), _1);
-      skch::Map mapper = skch::Map(parameters_split[i], referSketch, totalQueryFragments, queryno, fn);
+#pragma omp single
+      {
+        querySketches.assign(batch.second - batch.first, skch::QuerySketch());
+        queryGenomes.assign(batch.second - batch.first, cgi::Prefilter::QueryGenome());
+        pairGenomes.assign(pairCount, std::vector<bool>());
+      }
 
-      std::chrono::duration<double> timeMapQuery = skch::Time::now() - t0;
+      //Sketch query genomes of this batch once, in parallel
+#pragma omp for schedule(dynamic, 1)
+      for (uint64_t queryno = batch.first; queryno < batch.second; queryno++)
+      {
+        //Query genomes completed in an earlier run are not needed
+        if (checkpoint && checkpoint->isQueryComplete(queryno, blockCount))
+        {
+          queryReader.skip(queryno);
+          continue;
+        }
 
-      if ( omp_get_thread_num() == 0)
-        std::cerr << "INFO [thread 0], skch::main, Time spent mapping fragments in query #" << queryno + 1 <<  " : " << timeMapQuery.count() << " sec" << std::endl;
+        querySketches[queryno - batch.first].build(parameters, *queryReader.take(queryno));
+        queryGenomeLengths[queryno] = querySketches[queryno - batch.first].genomeLength;
 
-      t0 = skch::Time::now();
+        if (parameters.prefilter)
+          prefilter.sketchQuery(querySketches[queryno - batch.first], queryGenomes[queryno - batch.first]);
+      }
 
-      cgi::computeCGI(parameters_split[i], mapResults, mapper, referSketch, totalQueryFragments, queryno, fileName, finalResults_local);
+      std::chrono::duration<double> timeQuerySketch = skch::Time::now() - t0;
 
-      std::chrono::duration<double> timeCGI = skch::Time::now() - t0;
+      if ( tid == 0)
+        std::cerr << "INFO [thread 0], skch::main, Time spent sketching query genomes #" << batch.first + 1 << " - #" << batch.second << " : " << timeQuerySketch.count() << " sec" << std::endl;
 
-      if ( omp_get_thread_num() == 0)
-        std::cerr << "INFO [thread 0], skch::main, Time spent post mapping : " << timeCGI.count() << " sec" << std::endl;
-    }
+      //Prefilter selects the reference genomes of each pair not completed in an earlier run
+      if (parameters.prefilter)
+      {
+#pragma omp for schedule(dynamic, 1) reduction(+:prefilterPairs, prefilterSkippedPairs)
+        for (uint64_t pair = 0; pair < pairCount; pair++)
+        {
+          uint64_t queryno = batch.first + pair / blockCount;
+          uint64_t b = pair % blockCount;
 
-    cgi::correctRefGenomeIds (finalResults_local);
+          if (checkpoint && checkpoint->find(queryno, b) != nullptr)
+            continue;
 
-#pragma omp critical
-    {
-      finalResults.insert (finalResults.end(), finalResults_local.begin(), finalResults_local.end());
-    }
+          uint64_t selected = prefilter.selectGenomes(parameters, queryGenomes[queryno - batch.first], 
+              *referSketches[b], pairGenomes[pair]);
 
-#pragma omp critical
-    {
-      std::cerr << "INFO [thread " << omp_get_thread_num() << "], skch::main, ready to exit the loop" << std::endl;
+          prefilterPairs += pairGenomes[pair].size();
+          prefilterSkippedPairs += pairGenomes[pair].size() - selected;
+        }
+      }
+
+      //Tiles depend on count of fragments in each query genome
+#pragma omp single
+      {
+        cgi::makeTiles(parameters, batch, querySketches, refBlockSizes, tiles);
+
+        pairMappings.assign(pairCount, std::vector<skch::MappingResultsVector_t>());
+        pendingRanges.assign(pairCount, 0);
+        pairResults.assign(pairCount, std::vector<cgi::CGI_Results>());
+        pendingBlocks.assign(batch.second - batch.first, blockCount);
+
+        //Pairs completed in an earlier run take the saved results, and are not mapped again
+        if (checkpoint)
+        {
+          for (uint64_t pair = 0; pair < pairCount; pair++)
+          {
+            uint64_t queryno = batch.first + pair / blockCount;
+            auto saved = checkpoint->find(queryno, pair % blockCount);
+
+            if (saved != nullptr)
+            {
+              pairResults[pair] = saved->results;
+              queryGenomeLengths[queryno] = saved->queryGenomeLength;
+              pendingBlocks[queryno - batch.first]--;
+            }
+          }
+
+          tiles.erase( std::remove_if(tiles.begin(), tiles.end(), [&](const cgi::Tile &tile) 
+                {
+                  return checkpoint->find(tile.queryGenomeId, tile.refBlockId) != nullptr;
+                }), tiles.end());
+        }
+
+        //Pairs left without reference genomes by the prefilter are done, without results
+        if (parameters.prefilter)
+        {
+          auto isSkipped = [&](uint64_t pair)
+          {
+            return !pairGenomes[pair].empty() && 
+              std::find(pairGenomes[pair].begin(), pairGenomes[pair].end(), true) == pairGenomes[pair].end();
+          };
+
+          for (uint64_t pair = 0; pair < pairCount; pair++)
+          {
+            if (isSkipped(pair))
+            {
+              uint64_t queryno = batch.first + pair / blockCount;
+
+              if (checkpoint)
+                checkpoint->append(queryno, pair % blockCount, queryGenomeLengths[queryno], pairResults[pair]);
+
+              pendingBlocks[queryno - batch.first]--;
+            }
+          }
+
+          uint64_t tileCount = tiles.size();
+
+          tiles.erase( std::remove_if(tiles.begin(), tiles.end(), [&](const cgi::Tile &tile) 
+                {
+                  return isSkipped( (tile.queryGenomeId - batch.first) * blockCount + tile.refBlockId );
+                }), tiles.end());
+
+          prefilterTiles += tileCount;
+          prefilterSkippedTiles += tileCount - tiles.size();
+        }
+
+        //Query genomes done without mapping any of their pairs
+        for (uint64_t queryno = batch.first; queryno < batch.second; queryno++)
+          if (pendingBlocks[queryno - batch.first] == 0)
+            writer->submit(queryno, queryGenomeLengths[queryno], 
+                cgi::collectQueryResults(pairResults, queryno - batch.first, blockCount));
+
+        for (auto &tile : tiles)
+        {
+          uint64_t pair = (tile.queryGenomeId - batch.first) * blockCount + tile.refBlockId;
+          pairMappings[pair].resize( std::max<uint64_t>(pairMappings[pair].size(), tile.rangeId + 1) );
+          pendingRanges[pair]++;
+        }
+      }
+
+#pragma omp for schedule(dynamic, 1)
+      for (uint64_t i = 0; i < tiles.size(); i++)
+      {
+        uint64_t queryno = tiles[i].queryGenomeId;
+        uint64_t b = tiles[i].refBlockId;
+        uint64_t pair = (queryno - batch.first) * blockCount + b;
+
+        const skch::QuerySketch &querySketch = querySketches[queryno - batch.first];
+
+        t0 = skch::Time::now();
+
+        skch::MappingResultsVector_t &rangeResults = pairMappings[pair][tiles[i].rangeId];
+
+        auto fn = std::bind(skch::Map::insertL2ResultsToVec, std::ref(rangeResults), _1);
+        skch::Map mapper = skch::Map(parameters_split[b], *referSketches[b], statTable, querySketch, 
+            tiles[i].fragmentBegin, tiles[i].fragmentEnd, fn, 
+            pairGenomes[pair].empty() ? nullptr : &pairGenomes[pair]);
+
+        std::chrono::duration<double> timeMapQuery = skch::Time::now() - t0;
+
+        if ( tid == 0)
+          std::cerr << "INFO [thread 0], skch::main, Time spent mapping fragments in query #" << queryno + 1 <<  " : " << timeMapQuery.count() << " sec" << std::endl;
+
+        //Thread mapping the last fragment range of the pair computes its identity
+        uint64_t remaining;
+
+#pragma omp atomic capture seq_cst
+        remaining = --pendingRanges[pair];
+
+        if (remaining > 0)
+          continue;
+
+        t0 = skch::Time::now();
+
+        //Merge mappings in order of fragment ranges
+        skch::MappingResultsVector_t mapResults;
+        for (auto &e : pairMappings[pair])
+        {
+          mapResults.insert(mapResults.end(), e.begin(), e.end());
+          skch::MappingResultsVector_t().swap(e);
+        }
+
+        std::vector<cgi::CGI_Results> &results = pairResults[pair];
+        cgi::computeCGI(parameters_split[b], mapResults, querySketch, *referSketches[b], queryno, fileName, results);
+
+        cgi::correctRefGenomeIds (results, refGenomeBegin[b]);
+
+        if (checkpoint)
+          checkpoint->append(queryno, b, queryGenomeLengths[queryno], results);
+
+        //Thread completing the last block of the query genome submits its results
+#pragma omp atomic capture seq_cst
+        remaining = --pendingBlocks[queryno - batch.first];
+
+        if (remaining == 0)
+          writer->submit(queryno, queryGenomeLengths[queryno], 
+              cgi::collectQueryResults(pairResults, queryno - batch.first, blockCount));
+
+        std::chrono::duration<double> timeCGI = skch::Time::now() - t0;
+
+        if ( tid == 0)
+          std::cerr << "INFO [thread 0], skch::main, Time spent post mapping : " << timeCGI.count() << " sec" << std::endl;
+      }
     }
   }
 
   std::cerr << "INFO, skch::main, parallel_for execution finished" << std::endl;
 
-  std::unordered_map <std::string, uint64_t> genomeLengths;    // name of genome -> length
-  cgi::computeGenomeLengths(parameters, genomeLengths);
-
-  //report output in file
-  cgi::outputCGI (parameters, genomeLengths, finalResults, fileName);
+  if (parameters.prefilter)
+    std::cerr << "INFO, skch::main, prefilter skipped " << prefilterSkippedPairs << " of " << prefilterPairs 
+      << " (query genome, reference genome) pairs, and " << prefilterSkippedTiles << " of " << prefilterTiles 
+      << " tiles" << std::endl;
 
-  //report output as matrix
-  if (parameters.matrixOutput)
-    cgi::outputPhylip (parameters, genomeLengths, finalResults, fileName);
+  //Results are written as query genomes complete, report output as matrix if asked
+  writer->finish();
 }
@@ -0,0 +1,303 @@
+/**
+ * @file    binaryResults.hpp
+ * @brief   compact binary output of FastANI results, with genome dictionaries
+ *          and fixed-width records that can be memory-mapped
+ */
+
+#ifndef CGI_BINARY_RESULTS_HPP
+#define CGI_BINARY_RESULTS_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Own includes
+#include "map/include/commonFunc.hpp"
+#include "cgi/include/cgid_types.hpp"
+
+namespace cgi
+{
+  /**
+   * @namespace cgi::BinaryResults
+   * @brief     Binary results file, layout:
+   *            1.  header: magic, format version, record size, byte offset of the records,
+   *                record count
+   *            2.  genome dictionaries: query genome list, then reference genome list,
+   *                each one as a count followed by the names
+   *            3.  records, 8-byte aligned, in the same order as the text output
+   *            Record count is filled in once all records are written
+   */
+  namespace BinaryResults
+  {
+    const char magic[8] = {'F', 'A', 'N', 'I', 'R', 'E', 'S', '\0'};
+
+    //Revise this whenever the layout changes
+    const uint32_t formatVersion = 1;
+
+    //Byte offset of record offset and record count in the header
+    const uint64_t recordOffsetPos = sizeof(magic) + 2 * sizeof(uint32_t);
+
+    //Result of a genome pair, ids are positions in the genome dictionaries
+    struct Record
+    {
+      uint32_t qryGenomeId;
+      uint32_t refGenomeId;
+      float identity;
+      uint32_t countSeq;
+      uint32_t totalQueryFragments;
+    };
+
+    static_assert(sizeof(Record) == 20, "binary results record must be packed");
+
+    /**
+     * @class     cgi::BinaryResults::Writer
+     * @brief     writes a binary results file record by record
+     */
+    class Writer
+    {
+      private:
+
+        std::string fileName;
+        std::ofstream out;
+        uint64_t recordOffset = 0;
+        uint64_t recordCount = 0;
+
+      public:
+
+        /**
+         * @brief                       create the file and write header and genome dictionaries
+         * @param[in] fileName_
+         * @param[in] querySequences    query genome list
+         * @param[in] refSequences      reference genome list
+         */
+        void open(const std::string &fileName_,
+            const std::vector<std::string> &querySequences,
+            const std::vector<std::string> &refSequences)
+        {
+          fileName = fileName_;
+          out.open(fileName, std::ios::binary);
+
+          out.write(magic, sizeof(magic));
+          skch::CommonFunc::writePod(out, formatVersion);
+          skch::CommonFunc::writePod<uint32_t>(out, sizeof(Record));
+
+          //Record offset and count, filled in by close()
+          skch::CommonFunc::writePod<uint64_t>(out, 0);
+          skch::CommonFunc::writePod<uint64_t>(out, 0);
+
+          for (auto list : {&querySequences, &refSequences})
+          {
+            skch::CommonFunc::writePod<uint64_t>(out, list->size());
+            for (auto &e : *list)
+              skch::CommonFunc::writeString(out, e);
+          }
+
+          static const char padding[8] = {};
+          std::streamoff pos = out.tellp();
+          out.write(padding, (8 - pos % 8) % 8);
+
+          recordOffset = out.tellp();
+        }
+
+        /**
+         * @brief                       append a record
+         * @param[in] e                 result, with genome ids of the dictionaries
+         */
+        void write(const CGI_Results &e)
+        {
+          Record record = {(uint32_t) e.qryGenomeId, (uint32_t) e.refGenomeId, e.identity,
+            (uint32_t) e.countSeq, (uint32_t) e.totalQueryFragments};
+
+          skch::CommonFunc::writePod(out, record);
+          recordCount++;
+        }
+
+        /**
+         * @brief     complete the header and close the file
+         */
+        void close()
+        {
+          out.seekp(recordOffsetPos);
+          skch::CommonFunc::writePod(out, recordOffset);
+          skch::CommonFunc::writePod(out, recordCount);
+          out.close();
+
+          if (out.fail())
+          {
+            std::cerr << "ERROR, cgi::BinaryResults::Writer::close, Failed to write " << fileName << std::endl;
+            exit(1);
+          }
+        }
+    };
+
+    /**
+     * @class     cgi::BinaryResults::MappedFile
+     * @brief     binary results file, memory-mapped read-only, records are used in place
+     */
+    class MappedFile
+    {
+      private:
+
+        const char *base = nullptr;
+        uint64_t size = 0;
+
+      public:
+
+        std::vector<std::string> querySequences;
+        std::vector<std::string> refSequences;
+
+        const Record *records = nullptr;
+        uint64_t recordCount = 0;
+
+        MappedFile() = default;
+        MappedFile(const MappedFile &) = delete;
+        MappedFile & operator=(const MappedFile &) = delete;
+
+        ~MappedFile()
+        {
+          if (base != nullptr)
+            munmap((void *)base, size);
+        }
+
+        /**
+         * @brief                 map the file and read its genome dictionaries
+         * @param[in] fileName
+         */
+        void open(const std::string &fileName)
+        {
+          int fd = ::open(fileName.c_str(), O_RDONLY);
+          struct stat st;
+
+          if (fd < 0 || fstat(fd, &st) != 0)
+          {
+            std::cerr << "ERROR, cgi::BinaryResults::MappedFile::open, Could not open " << fileName << std::endl;
+            exit(1);
+          }
+
+          size = st.st_size;
+          void *addr = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+          close(fd);
+
+          if (addr == MAP_FAILED)
+          {
+            std::cerr << "ERROR, cgi::BinaryResults::MappedFile::open, Could not memory-map " << fileName << std::endl;
+            exit(1);
+          }
+
+          base = static_cast<const char *>(addr);
+
+          const char *p = base;
+          const char *end = base + size;
+
+          //Bounds checked read of the next value of the header
+          auto read = [&](void *val, uint64_t bytes)
+          {
+            if ((uint64_t)(end - p) < bytes)
+            {
+              std::cerr << "ERROR, cgi::BinaryResults::MappedFile::open, " << fileName << " is truncated or corrupt" << std::endl;
+              exit(1);
+            }
+
+            memcpy(val, p, bytes);
+            p += bytes;
+          };
+
+          char fileMagic[sizeof(magic)] = {};
+          uint32_t version = 0, recordSize = 0;
+          uint64_t recordOffset = 0;
+
+          if (size >= sizeof(magic))
+            read(fileMagic, sizeof(fileMagic));
+
+          if (memcmp(fileMagic, magic, sizeof(magic)) != 0)
+          {
+            std::cerr << "ERROR, cgi::BinaryResults::MappedFile::open, " << fileName << " is not a fastANI binary output" << std::endl;
+            exit(1);
+          }
+
+          read(&version, sizeof(version));
+          read(&recordSize, sizeof(recordSize));
+
+          if (version != formatVersion || recordSize != sizeof(Record))
+          {
+            std::cerr << "ERROR, cgi::BinaryResults::MappedFile::open, " << fileName << " has format version " << version
+              << ", expected " << formatVersion << std::endl;
+            exit(1);
+          }
+
+          read(&recordOffset, sizeof(recordOffset));
+          read(&recordCount, sizeof(recordCount));
+
+          for (auto list : {&querySequences, &refSequences})
+          {
+            uint64_t count = 0;
+            read(&count, sizeof(count));
+
+            for (uint64_t i = 0; i < count; i++)
+            {
+              uint32_t length = 0;
+              read(&length, sizeof(length));
+
+              list->emplace_back(length, '\0');
+              read(&list->back()[0], length);
+            }
+          }
+
+          if (recordOffset < (uint64_t)(p - base) || recordOffset % 8 != 0 ||
+              recordOffset + recordCount * sizeof(Record) != size)
+          {
+            std::cerr << "ERROR, cgi::BinaryResults::MappedFile::open, " << fileName << " is truncated or corrupt" << std::endl;
+            exit(1);
+          }
+
+          records = reinterpret_cast<const Record *>(base + recordOffset);
+
+          for (uint64_t i = 0; i < recordCount; i++)
+            if (records[i].qryGenomeId >= querySequences.size() || records[i].refGenomeId >= refSequences.size())
+            {
+              std::cerr << "ERROR, cgi::BinaryResults::MappedFile::open, record " << i << " of " << fileName
+                << " has an unknown genome id" << std::endl;
+              exit(1);
+            }
+        }
+    };
+
+    /**
+     * @brief                   convert a binary results file to the text output
+     * @param[in] fileName      binary results file
+     * @param[in] outFileName   text output file, standard output if empty
+     */
+    inline void convertToText(const std::string &fileName, const std::string &outFileName)
+    {
+      MappedFile results;
+      results.open(fileName);
+
+      std::ofstream outFile;
+      if (outFileName != "")
+        outFile.open(outFileName);
+
+      std::ostream &outstrm = outFileName != "" ? outFile : std::cout;
+
+      for (uint64_t i = 0; i < results.recordCount; i++)
+      {
+        const Record &e = results.records[i];
+
+        outstrm << results.querySequences[e.qryGenomeId]
+          << "\t" << results.refSequences[e.refGenomeId]
+          << "\t" << e.identity
+          << "\t" << e.countSeq
+          << "\t" << e.totalQueryFragments
+          << "\n";
+      }
+
+      outstrm.flush();
+    }
+  }
+}
+
+#endif
@@ -64,6 +64,17 @@ namespace cgi
     }
   } cmp_identity;
 
+  //Genome ranges computed by a shard of a run, as positions in the full genome lists
+  struct Shard
+  {
+    uint64_t queryBegin;              //first query genome of the shard
+    uint64_t queryEnd;                //end of query genomes of the shard
+    uint64_t queryCount;              //count of query genomes in the full list
+    uint64_t refBegin;                //first reference genome of the shard
+    uint64_t refEnd;                  //end of reference genomes of the shard
+    uint64_t refCount;                //count of reference genomes in the full list
+  };
+
   //Final format to save CGI results
   struct CGI_Results
   {
@@ -74,10 +85,23 @@ namespace cgi
     float identity;
 
     bool operator <(const CGI_Results& x) const {
-      return std::tie(x.qryGenomeId, identity) 
-        < std::tie(qryGenomeId, x.identity);
+      //Ties are broken by reference genome id, so that output does not depend on thread count
+      return std::tie(x.qryGenomeId, identity, x.refGenomeId) 
+        < std::tie(qryGenomeId, x.identity, refGenomeId);
     }
   };
+
+  //Unit of parallel work, mapping of a range of fragments of a query genome 
+  //against a block of reference genomes
+  struct Tile
+  {
+    uint64_t queryGenomeId;             //global id of the query genome
+    uint64_t refBlockId;                //id of the reference block
+    uint64_t rangeId;                   //index of the fragment range within this query genome
+    uint64_t fragmentBegin;             //[begin, end) range of query fragments
+    uint64_t fragmentEnd;
+    uint64_t cost;                      //estimated cost, used to schedule large tiles first
+  };
 }
 
 #endif
@@ -0,0 +1,520 @@
+/**
+ * @file    checkpoint.hpp
+ * @brief   durable log of completed (query genome, reference block) pairs,
+ *          so that an interrupted run can be resumed
+ */
+
+#ifndef CGI_CHECKPOINT_HPP
+#define CGI_CHECKPOINT_HPP
+
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//Own includes
+#include "map/include/base_types.hpp"
+#include "map/include/map_parameters.hpp"
+#include "map/include/commonFunc.hpp"
+#include "cgi/include/cgid_types.hpp"
+
+namespace cgi
+{
+  /**
+   * @class     cgi::Checkpoint
+   * @brief     checkpoint directory of a run, layout:
+   *            1.  manifest: magic, format version, sketching parameters, query and reference
+   *                genome lists, and the reference block boundaries of the run
+   *            2.  results: one record per completed (query genome, reference block) pair,
+   *                appended as the pairs complete: header (tag, query genome id, block id,
+   *                query genome length, result count), fields of each CGI_Results of the pair
+   *                with global genome ids (see appendResult()), and a checksum of the record
+   * @details   Records are written with a single append each. A sync thread syncs the log to
+   *            disk within syncInterval of an append (and at the end of the run), so a crash
+   *            loses at most the pairs completed in the last syncInterval. On resume, a torn
+   *            record at the end of the log is detected by its checksum and dropped. Resumed runs
+   *            use the block boundaries saved in the manifest, so that the thread count may
+   *            change between runs
+   */
+  class Checkpoint
+  {
+    public:
+
+      //Completed pair, as saved in the log
+      struct PairRecord
+      {
+        uint64_t queryGenomeLength;
+        std::vector<CGI_Results> results;
+      };
+
+    private:
+
+      const std::string manifestName = "manifest";
+      const std::string resultsName = "results";
+
+      //Revise this whenever the layout changes
+      const uint32_t formatVersion = 3;
+
+      const uint64_t recordTag = 0x31524b4350494e41ULL;   //"ANIPCKR1"
+
+      //Size of a serialized result, see appendResult()
+      const uint64_t resultSize = 4 * sizeof(int32_t) + sizeof(float);
+
+      //Upper bound on time between appending a record and syncing it to disk, by the sync thread
+      const std::chrono::seconds syncInterval = std::chrono::seconds(1);
+
+      std::string dir;
+      int fd = -1;
+
+      std::mutex mutex;
+      std::condition_variable stopRequested;
+
+      //Records were appended since the last sync
+      bool unsynced = false;
+      bool stopping = false;
+
+      std::thread syncer;
+
+      //Completed pairs loaded on resume, by (query genome id, block id)
+      std::map< std::pair<uint64_t, uint64_t>, PairRecord > completed;
+
+      //Count of completed blocks of each query genome
+      std::vector<uint64_t> completedBlocks;
+
+    public:
+
+      Checkpoint() = default;
+      Checkpoint(const Checkpoint &) = delete;
+      Checkpoint & operator=(const Checkpoint &) = delete;
+
+      ~Checkpoint()
+      {
+        if (syncer.joinable())
+        {
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+          }
+
+          stopRequested.notify_one();
+          syncer.join();
+        }
+
+        if (fd >= 0)
+        {
+          fdatasync(fd);
+          close(fd);
+        }
+      }
+
+      /**
+       * @brief                       start a new checkpoint directory, or resume from one
+       * @param[in]     parameters    run parameters, checkpointDir and resume are used
+       * @param[in/out] refGenomeBegin  block boundaries of this run, replaced by the saved
+       *                              ones on resume unless reference blocks come from an index
+       */
+      void open(const skch::Parameters &parameters, std::vector<uint64_t> &refGenomeBegin)
+      {
+        dir = parameters.checkpointDir;
+
+        if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+          std::cerr << "ERROR, cgi::Checkpoint::open, Could not create directory " << dir << std::endl;
+          exit(1);
+        }
+
+        std::string manifest = manifestPath();
+        std::string results = dir + "/" + resultsName;
+
+        struct stat st;
+        bool exists = stat(manifest.c_str(), &st) == 0;
+
+        if (!parameters.resume && exists)
+        {
+          std::cerr << "ERROR, cgi::Checkpoint::open, " << dir << " already holds a checkpoint, "
+            << "use --resume to continue it, or remove it" << std::endl;
+          exit(1);
+        }
+
+        if (parameters.resume && exists)
+        {
+          readManifest(parameters, refGenomeBegin);
+          uint64_t validSize = readResults(results, parameters.querySequences.size(), refGenomeBegin.size() - 1);
+
+          fd = ::open(results.c_str(), O_WRONLY | O_CREAT, 0666);
+
+          //Drop a torn record at the end, new records follow the valid ones
+          if (fd < 0 || ftruncate(fd, validSize) != 0 || lseek(fd, 0, SEEK_END) < 0)
+          {
+            std::cerr << "ERROR, cgi::Checkpoint::open, Could not open " << results << " for writing" << std::endl;
+            exit(1);
+          }
+
+          std::cerr << "INFO, cgi::Checkpoint::open, resuming from " << dir << ", " << completed.size() << " of "
+            << parameters.querySequences.size() * (refGenomeBegin.size() - 1)
+            << " (query genome, reference block) pairs are complete" << std::endl;
+        }
+        else
+        {
+          fd = ::open(results.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+          if (fd < 0)
+          {
+            std::cerr << "ERROR, cgi::Checkpoint::open, Could not open " << results << " for writing" << std::endl;
+            exit(1);
+          }
+
+          completedBlocks.assign(parameters.querySequences.size(), 0);
+
+          //Manifest is written last, it marks the directory as a checkpoint
+          writeManifest(parameters, refGenomeBegin);
+        }
+
+        syncer = std::thread(&Checkpoint::syncPeriodically, this);
+      }
+
+      /**
+       * @brief                       results of a pair completed in an earlier run
+       * @return                      null if the pair is not complete
+       */
+      const PairRecord* find(uint64_t queryGenomeId, uint64_t refBlockId) const
+      {
+        auto it = completed.find(std::make_pair(queryGenomeId, refBlockId));
+        return it == completed.end() ? nullptr : &it->second;
+      }
+
+      /**
+       * @brief                       true if all reference blocks of a query genome
+       *                              were completed in earlier runs
+       */
+      bool isQueryComplete(uint64_t queryGenomeId, uint64_t blockCount) const
+      {
+        return completedBlocks[queryGenomeId] == blockCount;
+      }
+
+      /**
+       * @brief                       append results of a completed pair to the log
+       * @param[in] queryGenomeId
+       * @param[in] refBlockId
+       * @param[in] queryGenomeLength
+       * @param[in] results           results of the pair, with global genome ids
+       */
+      void append(uint64_t queryGenomeId, uint64_t refBlockId, uint64_t queryGenomeLength,
+          const std::vector<CGI_Results> &results)
+      {
+        std::string record;
+        appendPod(record, recordTag);
+        appendPod(record, queryGenomeId);
+        appendPod(record, refBlockId);
+        appendPod(record, queryGenomeLength);
+        appendPod<uint64_t>(record, results.size());
+        for (auto &e : results)
+          appendResult(record, e);
+        appendPod(record, checksum(record.data(), record.size()));
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (!writeAll(fd, record))
+        {
+          std::cerr << "ERROR, cgi::Checkpoint::append, Failed to write to " << dir << std::endl;
+          exit(1);
+        }
+
+        unsynced = true;
+      }
+
+    private:
+
+      /**
+       * @brief   sync thread, syncs appended records to disk once per syncInterval
+       *          until the checkpoint is closed
+       */
+      void syncPeriodically()
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!stopping)
+        {
+          stopRequested.wait_for(lock, syncInterval);
+
+          if (unsynced)
+          {
+            unsynced = false;
+
+            //Appends go on while syncing
+            lock.unlock();
+            fdatasync(fd);
+            lock.lock();
+          }
+        }
+      }
+
+      /**
+       * @brief   path of the manifest file
+       */
+      std::string manifestPath() const
+      {
+        return dir + "/" + manifestName;
+      }
+
+      /**
+       * @brief   write all of data to a file descriptor
+       * @return  false on an error
+       */
+      static bool writeAll(int fd, const std::string &data)
+      {
+        for (uint64_t written = 0; written < data.size(); )
+        {
+          ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+
+          if (n < 0 && errno == EINTR)
+            continue;
+
+          if (n <= 0)
+            return false;
+
+          written += n;
+        }
+
+        return true;
+      }
+
+      /**
+       * @brief   append the bytes of a value to a record
+       */
+      template <typename T>
+        static void appendPod(std::string &s, const T &val)
+        {
+          s.append(reinterpret_cast<const char *>(&val), sizeof(T));
+        }
+
+      /**
+       * @brief   serialize the fields of a result, independent of the layout of CGI_Results
+       */
+      static void appendResult(std::string &s, const CGI_Results &e)
+      {
+        appendPod<int32_t>(s, e.refGenomeId);
+        appendPod<int32_t>(s, e.qryGenomeId);
+        appendPod<int32_t>(s, e.countSeq);
+        appendPod<int32_t>(s, e.totalQueryFragments);
+        appendPod<float>(s, e.identity);
+      }
+
+      /**
+       * @brief   deserialize a result written by appendResult()
+       */
+      static void extractResult(const char *p, CGI_Results &e)
+      {
+        int32_t fields[4];
+        memcpy(fields, p, sizeof(fields));
+        memcpy(&e.identity, p + sizeof(fields), sizeof(float));
+
+        e.refGenomeId = fields[0];
+        e.qryGenomeId = fields[1];
+        e.countSeq = fields[2];
+        e.totalQueryFragments = fields[3];
+      }
+
+      /**
+       * @brief   FNV-1a hash of a record
+       */
+      static uint64_t checksum(const char *data, uint64_t size)
+      {
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        for (uint64_t i = 0; i < size; i++)
+        {
+          h ^= (unsigned char) data[i];
+          h *= 0x100000001b3ULL;
+        }
+
+        return h;
+      }
+
+      /**
+       * @brief   parameters and genome lists that must match for resuming a run
+       */
+      std::string describeRun(const skch::Parameters &parameters) const
+      {
+        std::ostringstream out;
+
+        skch::CommonFunc::writePod(out, formatVersion);
+        skch::CommonFunc::writePod(out, parameters.kmerSize);
+        skch::CommonFunc::writePod(out, parameters.windowSize);
+        skch::CommonFunc::writePod(out, parameters.minReadLength);
+        skch::CommonFunc::writePod(out, parameters.alphabetSize);
+        skch::CommonFunc::writePod(out, parameters.percentageIdentity);
+        skch::CommonFunc::writePod(out, parameters.rollingHash);
+
+        //Pairs skipped by the prefilter depend on the reporting threshold
+        skch::CommonFunc::writePod(out, parameters.prefilter);
+        if (parameters.prefilter)
+          skch::CommonFunc::writePod(out, parameters.minFraction);
+
+        skch::CommonFunc::writePod<uint64_t>(out, parameters.querySequences.size());
+        for (auto &e : parameters.querySequences)
+          skch::CommonFunc::writeString(out, e);
+
+        skch::CommonFunc::writePod<uint64_t>(out, parameters.refSequences.size());
+        for (auto &e : parameters.refSequences)
+          skch::CommonFunc::writeString(out, e);
+
+        return out.str();
+      }
+
+      /**
+       * @brief                       write the manifest durably, replacing it atomically
+       * @details                     the manifest is synced before it is renamed into place,
+       *                              and the directory after, so that it is on disk before
+       *                              any record of the results log is
+       * @param[in]   parameters      run parameters
+       * @param[in]   refGenomeBegin  block boundaries of the run
+       */
+      void writeManifest(const skch::Parameters &parameters, const std::vector<uint64_t> &refGenomeBegin)
+      {
+        std::ostringstream out;
+
+        std::string run = describeRun(parameters);
+        skch::CommonFunc::writeString(out, run);
+
+        skch::CommonFunc::writePod<uint64_t>(out, refGenomeBegin.size());
+        out.write(reinterpret_cast<const char *>(refGenomeBegin.data()), refGenomeBegin.size() * sizeof(uint64_t));
+
+        std::string tmp = manifestPath() + ".tmp";
+        int tmpFd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+        bool written = tmpFd >= 0 && writeAll(tmpFd, out.str()) && fsync(tmpFd) == 0;
+
+        if (tmpFd >= 0)
+          close(tmpFd);
+
+        int dirFd = -1;
+
+        if (!written || rename(tmp.c_str(), manifestPath().c_str()) != 0 ||
+            (dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY)) < 0 || fsync(dirFd) != 0)
+        {
+          std::cerr << "ERROR, cgi::Checkpoint::writeManifest, Failed to write " << manifestPath() << std::endl;
+          exit(1);
+        }
+
+        close(dirFd);
+      }
+
+      /**
+       * @brief                       read the manifest, and check that it matches this run
+       * @param[in]     parameters    run parameters
+       * @param[in/out] refGenomeBegin  block boundaries of this run, replaced by the saved ones
+       */
+      void readManifest(const skch::Parameters &parameters, std::vector<uint64_t> &refGenomeBegin)
+      {
+        std::ifstream in(manifestPath(), std::ios::binary);
+
+        std::string run;
+        skch::CommonFunc::readString(in, run);
+
+        uint64_t boundaryCount = 0;
+        skch::CommonFunc::readPod(in, boundaryCount);
+
+        std::vector<uint64_t> savedGenomeBegin (in ? boundaryCount : 0);
+        in.read(reinterpret_cast<char *>(savedGenomeBegin.data()), savedGenomeBegin.size() * sizeof(uint64_t));
+
+        if (!in || boundaryCount < 2)
+        {
+          std::cerr << "ERROR, cgi::Checkpoint::readManifest, " << manifestPath() << " is truncated or corrupt" << std::endl;
+          exit(1);
+        }
+
+        if (run != describeRun(parameters) || savedGenomeBegin.back() != parameters.refSequences.size())
+        {
+          std::cerr << "ERROR, cgi::Checkpoint::readManifest, checkpoint in " << dir << " was made with different "
+            << "parameters or genome lists" << std::endl;
+          exit(1);
+        }
+
+        //Blocks of a reference index are fixed
+        if (parameters.refIndex != "" && savedGenomeBegin != refGenomeBegin)
+        {
+          std::cerr << "ERROR, cgi::Checkpoint::readManifest, checkpoint in " << dir << " was made with "
+            << "different reference blocks than the ones of " << parameters.refIndex << std::endl;
+          exit(1);
+        }
+
+        refGenomeBegin = savedGenomeBegin;
+      }
+
+      /**
+       * @brief                       load valid records of the results log
+       * @return                      size of the valid prefix of the log
+       */
+      uint64_t readResults(const std::string &fileName, uint64_t queryCount, uint64_t blockCount)
+      {
+        completedBlocks.assign(queryCount, 0);
+
+        std::ifstream in(fileName, std::ios::binary);
+        uint64_t validSize = 0;
+
+        struct stat st;
+        uint64_t fileSize = stat(fileName.c_str(), &st) == 0 ? st.st_size : 0;
+
+        const uint64_t headerSize = 5 * sizeof(uint64_t);
+
+        while (in)
+        {
+          std::string record (headerSize, '\0');
+
+          if (!in.read(&record[0], headerSize))
+            break;
+
+          uint64_t header[5];
+          memcpy(header, record.data(), headerSize);
+
+          uint64_t tag = header[0], queryGenomeId = header[1], refBlockId = header[2], count = header[4];
+
+          if (tag != recordTag || queryGenomeId >= queryCount || refBlockId >= blockCount)
+            break;
+
+          //Guard against a corrupt count before allocating
+          if (count > fileSize / resultSize)
+            break;
+
+          record.resize(headerSize + count * resultSize);
+          uint64_t savedChecksum = 0;
+
+          if (!in.read(&record[headerSize], count * resultSize))
+            break;
+
+          skch::CommonFunc::readPod(in, savedChecksum);
+
+          if (!in || savedChecksum != checksum(record.data(), record.size()))
+            break;
+
+          auto inserted = completed.emplace(std::make_pair(queryGenomeId, refBlockId), PairRecord());
+
+          if (inserted.second)
+            completedBlocks[queryGenomeId]++;
+
+          PairRecord &pair = inserted.first->second;
+          pair.queryGenomeLength = header[3];
+          pair.results.resize(count);
+
+          for (uint64_t i = 0; i < count; i++)
+            extractResult(record.data() + headerSize + i * resultSize, pair.results[i]);
+          validSize += record.size() + sizeof(uint64_t);
+        }
+
+        return validSize;
+      }
+  };
+}
+
+#endif
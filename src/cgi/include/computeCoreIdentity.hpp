@@ -15,6 +15,8 @@
 
 //Own includes
 #include "map/include/base_types.hpp"
+#include "map/include/commonFunc.hpp"
+#include "map/include/querySketch.hpp"
 #include "cgi/include/cgid_types.hpp"
 
 //External includes
@@ -23,6 +25,15 @@
 
 namespace cgi
 {
+  //Total size of query files (bytes) sketched together in a batch
+  const uint64_t queryBatchFileSize = 1ULL << 30;
+
+  //Reference blocks per thread in multi-threaded runs
+  const uint64_t refBlocksPerThread = 4;
+
+  //Minimum count of query fragments in a tile, when a query genome is split into fragment ranges
+  const uint64_t minFragmentsPerTile = 64;
+
   /**
    * @brief                       Use reference sketch's sequence to file (genome) mapping 
    *                              and revise reference ids to genome id
@@ -41,68 +52,18 @@ namespace cgi
     }
   }
 
-  /**
-   * @brief                       compute genome lengths in reference and query genome set
-   * @param[out] genomeLengths
-   */
-  void computeGenomeLengths(skch::Parameters &parameters, std::unordered_map <std::string, uint64_t> &genomeLengths) 
-  { 
-    for(auto &e : parameters.querySequences)
-    {
-      //Open the file using kseq
-      gzFile fp = gzopen(e.c_str(), "r");
-      kseq_t *seq = kseq_init(fp);
-      int l; uint64_t genomeLen = 0;
-
-      while ((l = kseq_read(seq)) >= 0) {
-        if (l >= parameters.minReadLength) {
-          uint64_t _l_ = (((uint64_t)strlen(seq->seq.s)) / parameters.minReadLength) * parameters.minReadLength;
-          genomeLen = genomeLen + _l_;
-        }
-      }
-
-      genomeLengths[e] = genomeLen;
-
-      kseq_destroy(seq);  
-      gzclose(fp); //close the file handler 
-    }
-
-    for(auto &e : parameters.refSequences)
-    {
-      if( genomeLengths.find(e) == genomeLengths.end() )
-      {
-        //Open the file using kseq
-        gzFile fp = gzopen(e.c_str(), "r");
-        kseq_t *seq = kseq_init(fp);
-        int l; uint64_t genomeLen = 0;
-
-      while ((l = kseq_read(seq)) >= 0) {
-        if (l >= parameters.minReadLength) {
-          uint64_t _l_ = (((uint64_t)strlen(seq->seq.s)) / parameters.minReadLength) * parameters.minReadLength;
-          genomeLen = genomeLen + _l_;
-        }
-      }
-
-        genomeLengths[e] = genomeLen;
-
-        kseq_destroy(seq);  
-        gzclose(fp); //close the file handler 
-      }
-    }
-  }
-
   /**
    * @brief                             output blast tabular mappings for visualization 
    * @param[in]   parameters            algorithm parameters
    * @param[in]   results               bidirectional mappings
-   * @param[in]   mapper                mapper object used for mapping
+   * @param[in]   querySketch           query sketch
    * @param[in]   refSketch             reference sketch
    * @param[in]   queryFileNo           query genome is parameters.querySequences[queryFileNo]
    * @param[in]   fileName              file name where results will be reported
    */
   void outputVisualizationFile(skch::Parameters &parameters,
       std::vector<MappingResult_CGI> &mappings_2way,
-      skch::Map &mapper,
+      const skch::QuerySketch &querySketch,
       skch::Sketch &refSketch,
       uint64_t queryFileNo,
       std::string &fileName)
@@ -110,23 +71,31 @@ namespace cgi
     std::ofstream outstrm(fileName + ".visual", std::ios::app);
 
     //Shift offsets for converting from local (to contig) to global (to genome)
-    std::vector <skch::offset_t> queryOffsetAdder (mapper.metadata.size());
-    std::vector <skch::offset_t> refOffsetAdder (refSketch.metadata.size());
+    std::vector <skch::offset_t> queryOffsetAdder (querySketch.metadata.size());
+    std::vector <skch::offset_t> refOffsetAdder (refSketch.getContigCount());
 
-    for(int i = 0; i < mapper.metadata.size(); i++)
+    for(int i = 0; i < querySketch.metadata.size(); i++)
     {
       if(i == 0)
         queryOffsetAdder[i] = 0;
       else
-        queryOffsetAdder[i] = queryOffsetAdder[i-1] + mapper.metadata[i-1].len;
+        queryOffsetAdder[i] = queryOffsetAdder[i-1] + querySketch.metadata[i-1].len;
     }
 
-    for(int i = 0; i < refSketch.metadata.size(); i++)
+    //Reference offsets restart at the first contig of each genome
+    skch::seqno_t genomeBegin = 0;
+
+    for(auto genomeEnd : refSketch.sequencesByFileInfo)
     {
-      if(i == 0)
-        refOffsetAdder[i] = 0;
-      else
-        refOffsetAdder[i] = refOffsetAdder[i-1] + refSketch.metadata[i-1].len;
+      for(skch::seqno_t i = genomeBegin; i < genomeEnd; i++)
+      {
+        if(i == genomeBegin)
+          refOffsetAdder[i] = 0;
+        else
+          refOffsetAdder[i] = refOffsetAdder[i-1] + refSketch.getContigLength(i-1);
+      }
+
+      genomeBegin = genomeEnd;
     }
 
     //Report all mappings that contribute to core-genome identity estimate
@@ -153,18 +122,17 @@ namespace cgi
    * @brief                             compute and report AAI/ANI 
    * @param[in]   parameters            algorithm parameters
    * @param[in]   results               mapping results
-   * @param[in]   mapper                mapper object used for mapping
+   * @param[in]   querySketch           query sketch, also provides count of total 
+   *                                    sequence fragments in query genome
    * @param[in]   refSketch             reference sketch
-   * @param[in]   totalQueryFragments   count of total sequence fragments in query genome
    * @param[in]   queryFileNo           query genome is parameters.querySequences[queryFileNo]
    * @param[in]   fileName              file name where results will be reported
    * @param[out]  CGI_ResultsVector     FastANI results
    */
   void computeCGI(skch::Parameters &parameters,
       skch::MappingResultsVector_t &results,
-      skch::Map &mapper,
+      const skch::QuerySketch &querySketch,
       skch::Sketch &refSketch,
-      uint64_t totalQueryFragments,
       uint64_t queryFileNo,
       std::string &fileName,
       std::vector<cgi::CGI_Results> &CGI_ResultsVector
@@ -254,7 +222,9 @@ namespace cgi
     {
       if(parameters.visualize)
       {
-        outputVisualizationFile(parameters, mappings_2way, mapper, refSketch, queryFileNo, fileName);
+        //Tiles are processed concurrently, append to the file one at a time
+#pragma omp critical (visualization)
+        outputVisualizationFile(parameters, mappings_2way, querySketch, refSketch, queryFileNo, fileName);
       }
     }
 
@@ -284,7 +254,7 @@ namespace cgi
       currentResult.qryGenomeId = queryFileNo;
       currentResult.refGenomeId = currentGenomeId;
       currentResult.countSeq = std::distance(it, rangeEndIter);
-      currentResult.totalQueryFragments = totalQueryFragments;
+      currentResult.totalQueryFragments = querySketch.totalQueryFragments;
       currentResult.identity = sumIdentity/currentResult.countSeq;
 
       CGI_ResultsVector.push_back(currentResult);
@@ -295,192 +265,418 @@ namespace cgi
   }
 
   /**
-   * @brief                             output FastANI results to file
-   * @param[in]   parameters            algorithm parameters
-   * @param[in]   genomeLengths
-   * @param[in]   CGI_ResultsVector     results
-   * @param[in]   fileName              file name where results will be reported
+   * @class     cgi::PhylipMatrix
+   * @brief     lower triangular matrix of ANI values over the union of query and reference genomes
+   * @details   Genomes are numbered in order of first occurrence in the query list, then in the
+   *            reference list. ANI values reported in both directions for a genome pair are averaged.
+   *            Only reported values are kept, as (row, column, value) cells, the matrix is written
+   *            row by row with NA filled in between. Memory is proportional to the count of reported
+   *            values, not to the square of the count of genomes
    */
-  void outputCGI(skch::Parameters &parameters,
-      std::unordered_map <std::string, uint64_t> &genomeLengths,
-      std::vector<cgi::CGI_Results> &CGI_ResultsVector,
-      std::string &fileName)
+  class PhylipMatrix
   {
-    //sort result by identity
-    std::sort(CGI_ResultsVector.rbegin(), CGI_ResultsVector.rend());
+    private:
 
-    std::ofstream outstrm(fileName);
+      //Reported ANI value, below the diagonal
+      struct Cell
+      {
+        int row;
+        int col;
+        float identity;
+      };
 
-    //Report results
-    for(auto &e : CGI_ResultsVector)
-    {
-      std::string qryGenome = parameters.querySequences[e.qryGenomeId];
-      std::string refGenome = parameters.refSequences[e.refGenomeId];
+      //Names of genomes, in matrix order
+      std::vector<std::string> genomes;
 
-      assert(genomeLengths.find(qryGenome) != genomeLengths.end());
-      assert(genomeLengths.find(refGenome) != genomeLengths.end());
+      //Matrix index of each query and reference genome
+      std::vector<int> queryIndex;
+      std::vector<int> refIndex;
 
-      uint64_t queryGenomeLength = genomeLengths[qryGenome];
-      uint64_t refGenomeLength = genomeLengths[refGenome]; 
-      uint64_t minGenomeLength = std::min(queryGenomeLength, refGenomeLength);
-      uint64_t sharedLength = e.countSeq * parameters.minReadLength;
+      //Reported values in the order they were added
+      std::vector<Cell> cells;
 
-      //Checking if shared genome is above a certain fraction of genome length
-      if(sharedLength >= minGenomeLength * parameters.minFraction)
+    public:
+
+      /**
+       * @param[in]   querySequences      query genome list
+       * @param[in]   refSequences        reference genome list
+       */
+      PhylipMatrix(const std::vector<std::string> &querySequences,
+          const std::vector<std::string> &refSequences)
       {
-        outstrm << qryGenome
-          << "\t" << refGenome
-          << "\t" << e.identity 
-          << "\t" << e.countSeq
-          << "\t" << e.totalQueryFragments
-          << "\n";
+        std::unordered_map <std::string, int> genome2Int;    // name of genome -> integer
+
+        //Assign unique index to the set of query and reference genomes
+        auto assign = [&](const std::string &e)
+        {
+          auto it = genome2Int.find(e);
+          if (it != genome2Int.end())
+            return it->second;
+
+          int id = genomes.size();
+          genome2Int [e] = id;
+          genomes.push_back(e);
+          return id;
+        };
+
+        for(auto &e : querySequences)
+          queryIndex.push_back( assign(e) );
+
+        for(auto &e : refSequences)
+          refIndex.push_back( assign(e) );
       }
-    }
 
-    outstrm.close();
-  }
+      /**
+       * @brief                         add a reported ANI value
+       * @param[in]   qryGenomeId       id in the query genome list
+       * @param[in]   refGenomeId       id in the reference genome list
+       * @param[in]   identity
+       */
+      void add(uint64_t qryGenomeId, uint64_t refGenomeId, float identity)
+      {
+        int qGenome = queryIndex [ qryGenomeId ];
+        int rGenome = refIndex [ refGenomeId ];
+
+        if (qGenome == rGenome)   //ignore if both genomes are same
+          return;
+
+        cells.push_back( Cell{std::max(qGenome, rGenome), std::min(qGenome, rGenome), identity} );
+      }
+
+      /**
+       * @brief                         write the matrix in phylip format
+       * @param[in]   fileName
+       */
+      void write(const std::string &fileName)
+      {
+        //Order cells by position, values of the same pair stay in the order they were added
+        std::stable_sort(cells.begin(), cells.end(), [](const Cell &x, const Cell &y)
+            {
+              return std::tie(x.row, x.col) < std::tie(y.row, y.col);
+            });
+
+        std::ofstream outstrm(fileName);
+
+        int totalGenomes = genomes.size();
+        outstrm << totalGenomes << "\n";
+
+        auto it = cells.begin();
+
+        //Report matrix
+        for (int i = 0; i < totalGenomes; i++)
+        {
+          //output genome name
+          outstrm << genomes[i];
+
+          for (int j = 0; j < i; j++)
+          {
+            if (it == cells.end() || it->row != i || it->col != j)
+            {
+              outstrm << "\tNA";
+              continue;
+            }
+
+            //output ani values
+            //average if computed twice
+            float identity = it->identity;
+            for (it++; it != cells.end() && it->row == i && it->col == j; it++)
+              identity = (identity + it->identity)/2;
+
+            outstrm << "\t" << std::to_string (identity); 
+          }
+          outstrm << "\n";
+        }
+
+        outstrm.close();
+      }
+  };
 
   /**
-   * @brief                             output FastANI results as lower triangular matrix
-   * @param[in]   parameters            algorithm parameters
-   * @param[in]   genomeLengths
-   * @param[in]   CGI_ResultsVector     results
-   * @param[in]   fileName              file name where results will be reported
+   * @brief                         divide the list of query genomes into batches
+   * @details                       query genomes of a batch are sketched together and their 
+   *                                sketches are kept in memory until the batch is mapped,
+   *                                batch size is bounded by the total size of query files
+   * @param[in]   parameters
+   * @param[out]  queryBatches      [begin, end) range of query genome ids in each batch
    */
-  void outputPhylip(skch::Parameters &parameters,
-      std::unordered_map <std::string, uint64_t> &genomeLengths,
-      std::vector<cgi::CGI_Results> &CGI_ResultsVector,
-      std::string &fileName)
+  void splitQueryGenomes(skch::Parameters &parameters,
+      std::vector < std::pair<uint64_t, uint64_t> > &queryBatches)
   {
-    std::unordered_map <std::string, int> genome2Int;    // name of genome -> integer
-    std::unordered_map <int, std::string> genome2Int_rev; // integer -> name of genome
+    uint64_t batchBegin = 0;
+    uint64_t batchFileSize = 0;
 
-    //Assign unique index to the set of query and reference genomes
-    for(auto &e : parameters.querySequences)
+    for (uint64_t i = 0; i < parameters.querySequences.size(); i++)
     {
-      auto id = genome2Int.size();
-      if( genome2Int.find(e) == genome2Int.end() )
-      {
-        genome2Int [e] = id;
-        genome2Int_rev [id] = e;
-      }
-    }
+      batchFileSize += skch::CommonFunc::getReferenceSize( std::vector<std::string> {parameters.querySequences[i]} );
 
-    for(auto &e : parameters.refSequences)
-    {
-      auto id = genome2Int.size();
-      if( genome2Int.find(e) == genome2Int.end() )
+      if (batchFileSize >= queryBatchFileSize || i + 1 == parameters.querySequences.size())
       {
-        genome2Int [e] = id;
-        genome2Int_rev [id] = e;
+        queryBatches.emplace_back(batchBegin, i + 1);
+        batchBegin = i + 1;
+        batchFileSize = 0;
       }
     }
+  }
 
-    int totalGenomes = genome2Int.size();
+  /**
+   * @brief                         count of reference blocks to split the reference genomes into
+   * @details                       tiles (query genome x reference block) are the unit of work
+   *                                stealing, multi-threaded runs aim for refBlocksPerThread tiles
+   *                                per thread. Reference is split just enough for that, given the
+   *                                count of query genomes, but into at least one block per thread
+   *                                so that reference genomes are sketched in parallel. Many query
+   *                                genomes thus run in parallel against a few large blocks, and
+   *                                few query genomes against many small ones. Without query
+   *                                genomes (indexing), refBlocksPerThread blocks per thread are used
+   * @param[in]   parameters
+   * @return                        block count
+   */
+  uint64_t referenceBlockCount(skch::Parameters &parameters)
+  {
+    if (parameters.threads <= 1)
+      return 1;
 
-    //create a square 2-d matrix
-    std::vector< std::vector<float> > fastANI_matrix (totalGenomes,  std::vector<float> (totalGenomes, 0.0));
+    uint64_t threads = parameters.threads;
+    uint64_t targetTiles = threads * refBlocksPerThread;
+    uint64_t queryCount = parameters.querySequences.size();
 
-    //transform FastANI results into 3-tuples
-    for(auto &e : CGI_ResultsVector)
-    {
-      std::string qryGenome = parameters.querySequences[e.qryGenomeId];
-      std::string refGenome = parameters.refSequences[e.refGenomeId];
+    uint64_t blockCount = queryCount > 0 ? (targetTiles + queryCount - 1) / queryCount : targetTiles;
+    blockCount = std::min(std::max(blockCount, threads), targetTiles);
 
-      assert(genomeLengths.find(qryGenome) != genomeLengths.end());
-      assert(genomeLengths.find(refGenome) != genomeLengths.end());
+    return std::min<uint64_t>(blockCount, parameters.refSequences.size());
+  }
 
-      uint64_t queryGenomeLength = genomeLengths[qryGenome];
-      uint64_t refGenomeLength = genomeLengths[refGenome]; 
-      uint64_t minGenomeLength = std::min(queryGenomeLength, refGenomeLength);
-      uint64_t sharedLength = e.countSeq * parameters.minReadLength;
+  /**
+   * @brief                         divide a list of genomes into contiguous blocks
+   *                                of similar total file size
+   * @details                       min(blockCount, count of genomes) blocks are made
+   * @param[in]   genomes
+   * @param[in]   blockCount        requested count of blocks
+   * @param[out]  genomeBegin       id of the first genome of each block,
+   *                                followed by the count of genomes
+   */
+  void partitionGenomes(const std::vector<std::string> &genomes,
+      uint64_t blockCount,
+      std::vector <uint64_t> &genomeBegin)
+  {
+    uint64_t genomeCount = genomes.size();
+    uint64_t totalSize = skch::CommonFunc::getReferenceSize(genomes);
+    uint64_t sizeSoFar = 0;
 
-      //Checking if shared genome is above a certain fraction of genome length
-      if(sharedLength >= minGenomeLength * parameters.minFraction)
-      {
-        int qGenome = genome2Int [ qryGenome ];
-        int rGenome = genome2Int [ refGenome ];
+    genomeBegin.assign(1, 0);
 
-        if (qGenome != rGenome)   //ignore if both genomes are same
-        {
-          if (qGenome > rGenome)
-          {
-            if (fastANI_matrix[qGenome][rGenome] > 0)
-              fastANI_matrix[qGenome][rGenome] = (fastANI_matrix[qGenome][rGenome] + e.identity)/2;
-            else
-              fastANI_matrix[qGenome][rGenome] = e.identity;
-          }
-          else
-          {
-            if (fastANI_matrix[rGenome][qGenome] > 0)
-              fastANI_matrix[rGenome][qGenome] = (fastANI_matrix[rGenome][qGenome] + e.identity)/2;
-            else
-              fastANI_matrix[rGenome][qGenome] = e.identity;
-          }
-        }
-      }
+    for (uint64_t j = 0; j + 1 < genomeCount && genomeBegin.size() < blockCount; j++)
+    {
+      sizeSoFar += skch::CommonFunc::getReferenceSize( std::vector<std::string> {genomes[j]} );
+
+      //Close the block once it holds its share of the genomes, 
+      //or if the remaining genomes are just enough for one block each
+      if (sizeSoFar * blockCount >= totalSize * genomeBegin.size() || 
+          genomeCount - j - 1 == blockCount - genomeBegin.size())
+        genomeBegin.push_back(j + 1);
     }
 
-    std::ofstream outstrm(fileName + ".matrix");
+    genomeBegin.push_back(genomeCount);
+  }
 
-    outstrm << totalGenomes << "\n";
+  /**
+   * @brief                         divide the list of reference genomes into contiguous blocks
+   *                                of similar total file size
+   * @param[in]   parameters
+   * @param[in]   blockCount        requested count of blocks
+   * @param[out]  refGenomeBegin    global id of the first reference genome of each block,
+   *                                followed by the count of reference genomes
+   */
+  void partitionReferenceGenomes(skch::Parameters &parameters,
+      uint64_t blockCount,
+      std::vector <uint64_t> &refGenomeBegin)
+  {
+    partitionGenomes(parameters.refSequences, blockCount, refGenomeBegin);
+  }
 
-    //Report matrix
-    for (int i = 0; i < totalGenomes; i++)
+  /**
+   * @brief                         restrict a run to its shard of (query genome, reference genome) pairs
+   * @details                       pairs are split into a grid of query groups x reference groups,
+   *                                each group being a contiguous range of genomes of similar total
+   *                                file size. Among the grids with shardCount cells, the one with the
+   *                                least total sketching work is used: every query genome is sketched
+   *                                once per reference group, and every reference genome once per query
+   *                                group. Reference genomes of an index are not sketched, so those
+   *                                runs are split by query genomes only. Shards are numbered row-wise.
+   *                                Grid depends on the genome lists and shard count only, so
+   *                                that separate runs agree on it
+   * @param[in/out] parameters      genome lists are restricted to the ones of the shard
+   * @param[out]    shard           genome ranges of the shard within the full lists
+   */
+  void selectShard(skch::Parameters &parameters, Shard &shard)
+  {
+    bool refIndexed = parameters.refIndex != "";
+
+    uint64_t shardCount = parameters.shardCount;
+    uint64_t queryCount = parameters.querySequences.size();
+    uint64_t refCount = parameters.refSequences.size();
+
+    uint64_t querySize = skch::CommonFunc::getReferenceSize(parameters.querySequences);
+    uint64_t refSize = refIndexed ? 0 : skch::CommonFunc::getReferenceSize(parameters.refSequences);
+
+    //Pick count of query groups, reference group count follows
+    uint64_t queryGroups = 0;
+    uint64_t bestCost = 0;
+
+    for (uint64_t a = 1; a <= shardCount; a++)
     {
-      //output genome name
-      outstrm << genome2Int_rev[i];
+      uint64_t b = shardCount / a;
+
+      if (a * b != shardCount || a > queryCount || b > refCount || (refIndexed && b > 1))
+        continue;
+
+      uint64_t cost = b * querySize + a * refSize;
 
-      for (int j = 0; j < i; j++)
+      if (queryGroups == 0 || cost < bestCost)
       {
-        //output ani values
-        //average if computed twice
-        std::string val = fastANI_matrix[i][j] > 0.0 ? std::to_string (fastANI_matrix[i][j]) : "NA";
-        outstrm << "\t" << val; 
+        queryGroups = a;
+        bestCost = cost;
       }
-      outstrm << "\n";
     }
 
-    outstrm.close();
+    if (queryGroups == 0)
+    {
+      std::cerr << "ERROR, cgi::selectShard, " << queryCount << " query and " << refCount 
+        << " reference genomes can not be split into " << shardCount << " shards" 
+        << (refIndexed ? " (shards of an indexed reference split query genomes only)" : "") << std::endl;
+      exit(1);
+    }
+
+    uint64_t refGroups = shardCount / queryGroups;
+    uint64_t shardId = parameters.shardId - 1;
+
+    std::vector <uint64_t> queryGroupBegin, refGroupBegin;
+    partitionGenomes(parameters.querySequences, queryGroups, queryGroupBegin);
+    partitionGenomes(parameters.refSequences, refGroups, refGroupBegin);
+
+    shard.queryBegin = queryGroupBegin[shardId / refGroups];
+    shard.queryEnd = queryGroupBegin[shardId / refGroups + 1];
+    shard.queryCount = queryCount;
+    shard.refBegin = refGroupBegin[shardId % refGroups];
+    shard.refEnd = refGroupBegin[shardId % refGroups + 1];
+    shard.refCount = refCount;
+
+    std::cerr << "INFO, cgi::selectShard, shard " << parameters.shardId << "/" << shardCount << " of a " 
+      << queryGroups << " x " << refGroups << " grid computes query genomes #" << shard.queryBegin + 1 << " - #" << shard.queryEnd 
+      << " against reference genomes #" << shard.refBegin + 1 << " - #" << shard.refEnd << std::endl;
+
+    parameters.querySequences.assign(parameters.querySequences.begin() + shard.queryBegin, 
+        parameters.querySequences.begin() + shard.queryEnd);
+
+    //Reference genomes of an index stay in place, all of them are in the shard
+    if (!refIndexed)
+      parameters.refSequences.assign(parameters.refSequences.begin() + shard.refBegin, 
+          parameters.refSequences.begin() + shard.refEnd);
   }
 
   /**
    * @brief                         generate multiple parameter objects from one
    * @details                       purpose it to divide the list of reference genomes
-   *                                into as many buckets as there are threads 
+   *                                into blocks, one parameter object per block
    * @param[in]   parameters
+   * @param[in]   refGenomeBegin    block boundaries, see partitionReferenceGenomes()
    * @param[out]  parameters_split
    */
   void splitReferenceGenomes(skch::Parameters &parameters,
+      const std::vector <uint64_t> &refGenomeBegin,
       std::vector <skch::Parameters> &parameters_split)
   {
-    for (int i = 0; i < parameters.threads; i++)
+    parameters_split.resize(refGenomeBegin.size() - 1);
+
+    for (uint64_t i = 0; i < parameters_split.size(); i++)
     {
       parameters_split[i] = parameters;
 
       //update the reference genomes list
-      parameters_split[i].refSequences.clear();
+      parameters_split[i].refSequences.assign (parameters.refSequences.begin() + refGenomeBegin[i],
+          parameters.refSequences.begin() + refGenomeBegin[i+1]);
+    }
+  }
 
-      //assign ref. genome to threads in round-robin fashion
-      for (int j = 0; j < parameters.refSequences.size(); j++)
-      {
-        if (j % parameters.threads == i)
-          parameters_split[i].refSequences.push_back (parameters.refSequences[j]);
-      }
+  /**
+   * @brief                         list (query genome, reference block, fragment range) tiles
+   *                                of a query batch in decreasing order of their estimated cost
+   * @details                       cost is estimated as product of query and reference file sizes,
+   *                                scheduling the largest tiles first keeps the tail short.
+   *                                If there are fewer (query genome, reference block) pairs than
+   *                                refBlocksPerThread per thread, e.g. one-to-one runs, the query
+   *                                fragments of each pair are split into ranges mapped in parallel
+   * @param[in]   parameters
+   * @param[in]   queryBatch        [begin, end) range of query genome ids
+   * @param[in]   querySketches     sketches of the query genomes of the batch
+   * @param[in]   refBlockSizes     total file size of each reference block
+   * @param[out]  tiles
+   */
+  void makeTiles(skch::Parameters &parameters,
+      const std::pair<uint64_t, uint64_t> &queryBatch,
+      const std::vector <skch::QuerySketch> &querySketches,
+      const std::vector <uint64_t> &refBlockSizes,
+      std::vector <Tile> &tiles)
+  {
+    tiles.clear();
+
+    uint64_t pairCount = (queryBatch.second - queryBatch.first) * refBlockSizes.size();
+    uint64_t targetTiles = parameters.threads > 1 ? (uint64_t) parameters.threads * refBlocksPerThread : 1;
+    uint64_t rangesPerPair = (targetTiles + pairCount - 1) / pairCount;
+
+    for (uint64_t q = queryBatch.first; q < queryBatch.second; q++)
+    {
+      uint64_t querySize = skch::CommonFunc::getReferenceSize( std::vector<std::string> {parameters.querySequences[q]} );
+      uint64_t fragmentCount = querySketches[q - queryBatch.first].fragments.size();
+
+      uint64_t rangeCount = std::max<uint64_t>(1, std::min(rangesPerPair, fragmentCount / minFragmentsPerTile));
+
+      for (uint64_t b = 0; b < refBlockSizes.size(); b++)
+        for (uint64_t r = 0; r < rangeCount; r++)
+          tiles.push_back( Tile{q, b, r, 
+              fragmentCount * r / rangeCount, fragmentCount * (r + 1) / rangeCount,
+              querySize * refBlockSizes[b] / rangeCount} );
     }
+
+    std::stable_sort(tiles.begin(), tiles.end(), [](const Tile &x, const Tile &y) 
+        {
+          return x.cost > y.cost;
+        });
   }
 
   /**
-   * @brief                             update thread local reference genome ids to global ids
+   * @brief                             update block local reference genome ids to global ids
    * @param[in/out] CGI_ResultsVector
+   * @param[in]     refGenomeBegin      global id of the first genome of the reference block 
+   *                                    these results come from
    */
-  void correctRefGenomeIds (std::vector<cgi::CGI_Results> &CGI_ResultsVector)
+  void correctRefGenomeIds (std::vector<cgi::CGI_Results> &CGI_ResultsVector, uint64_t refGenomeBegin)
   {
-    int tid = omp_get_thread_num();
-    int thread_count = omp_get_num_threads(); 
-    
     for (auto &e : CGI_ResultsVector)
-      e.refGenomeId = e.refGenomeId * thread_count +  tid;
+      e.refGenomeId += refGenomeBegin;
+  }
+
+  /**
+   * @brief                             move out results of a query genome against all reference blocks
+   * @param[in/out] pairResults         results of each (query genome, reference block) pair of a query batch,
+   *                                    saved at (query genome - batch begin) * blockCount + block
+   * @param[in]     queryIndex          query genome - batch begin
+   * @param[in]     blockCount
+   * @return                            results of the query genome
+   */
+  std::vector<cgi::CGI_Results> collectQueryResults (std::vector< std::vector<cgi::CGI_Results> > &pairResults, 
+      uint64_t queryIndex, uint64_t blockCount)
+  {
+    std::vector<cgi::CGI_Results> queryResults;
+
+    for (uint64_t b = 0; b < blockCount; b++)
+    {
+      std::vector<cgi::CGI_Results> &results = pairResults[queryIndex * blockCount + b];
+      queryResults.insert (queryResults.end(), results.begin(), results.end());
+      std::vector<cgi::CGI_Results>().swap(results);
+    }
+
+    return queryResults;
   }
 }
 
@@ -0,0 +1,227 @@
+/**
+ * @file    mergeShards.hpp
+ * @brief   combines the outputs of the shards of a run (--shard i/N) into the
+ *          output of the whole run
+ */
+
+#ifndef CGI_MERGE_SHARDS_HPP
+#define CGI_MERGE_SHARDS_HPP
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <fstream>
+#include <sstream>
+#include <memory>
+
+//Own includes
+#include "map/include/map_parameters.hpp"
+#include "cgi/include/cgid_types.hpp"
+#include "cgi/include/computeCoreIdentity.hpp"
+#include "cgi/include/binaryResults.hpp"
+
+namespace cgi
+{
+  /**
+   * @class     cgi::ShardReader
+   * @brief     reads the output of a shard one result at a time, see ResultWriter for the format
+   */
+  class ShardReader
+  {
+    private:
+
+      std::string fileName;
+      std::ifstream in;
+      uint64_t lineNumber = 0;
+
+    public:
+
+      //Header of the shard
+      int shardId;
+      int shardCount;
+      uint64_t queryCount;
+      uint64_t refCount;
+
+      //Result read last
+      CGI_Results current;
+
+      /**
+       * @brief                 open a shard output and read its header
+       * @param[in] fileName_
+       */
+      ShardReader(const std::string &fileName_) : fileName(fileName_), in(fileName_)
+      {
+        std::string line, tag;
+
+        if (in.fail())
+        {
+          std::cerr << "ERROR, cgi::ShardReader, Could not open " << fileName << std::endl;
+          exit(1);
+        }
+
+        std::getline(in, line);
+        lineNumber++;
+
+        std::istringstream header(line);
+
+        if (!(header >> tag >> shardId >> shardCount >> queryCount >> refCount) || tag != "#fastANI-shard")
+        {
+          std::cerr << "ERROR, cgi::ShardReader, " << fileName << " is not the output of a fastANI shard" << std::endl;
+          exit(1);
+        }
+      }
+
+      /**
+       * @brief                 read the next result into current
+       * @return                false at the end of the file
+       */
+      bool next()
+      {
+        std::string line;
+
+        if (!std::getline(in, line))
+          return false;
+
+        lineNumber++;
+
+        CGI_Results previous = current;
+        std::istringstream fields(line);
+
+        if (!(fields >> current.qryGenomeId >> current.refGenomeId >> current.identity
+              >> current.countSeq >> current.totalQueryFragments) ||
+            current.qryGenomeId < 0 || (uint64_t) current.qryGenomeId >= queryCount ||
+            current.refGenomeId < 0 || (uint64_t) current.refGenomeId >= refCount)
+        {
+          std::cerr << "ERROR, cgi::ShardReader::next, " << fileName << " line " << lineNumber << " is malformed" << std::endl;
+          exit(1);
+        }
+
+        //Results are written in decreasing order of CGI_Results::operator<
+        if (lineNumber > 2 && previous < current)
+        {
+          std::cerr << "ERROR, cgi::ShardReader::next, " << fileName << " line " << lineNumber << " is out of order" << std::endl;
+          exit(1);
+        }
+
+        return true;
+      }
+  };
+
+  /**
+   * @brief                             merge shard outputs into the output of the whole run,
+   *                                    in the same order as ResultWriter, and optionally the
+   *                                    same lower triangular matrix
+   * @details                           shard outputs are sorted, so a k-way merge streams them
+   *                                    holding one result per shard. The matrix is filled as the
+   *                                    results stream by, ANI values of both directions of a pair
+   *                                    are averaged by PhylipMatrix
+   * @param[in]   parameters            full genome lists of the run, output file name, matrixOutput
+   * @param[in]   shardFiles            outputs of all shards of the run, in any order
+   */
+  void mergeShards(skch::Parameters &parameters, const std::vector<std::string> &shardFiles)
+  {
+    std::vector< std::unique_ptr<ShardReader> > shards;
+
+    for (auto &f : shardFiles)
+      shards.emplace_back(new ShardReader(f));
+
+    //All shards of one run, for the given genome lists
+    int shardCount = shards.front()->shardCount;
+    std::vector<bool> seen (shardCount, false);
+
+    for (uint64_t i = 0; i < shards.size(); i++)
+    {
+      ShardReader &s = *shards[i];
+
+      if (s.shardCount != shardCount || s.shardId < 1 || s.shardId > shardCount || seen[s.shardId - 1])
+      {
+        std::cerr << "ERROR, cgi::mergeShards, " << shardFiles[i] << " is shard " << s.shardId << "/" << s.shardCount
+          << ", expected distinct shards of " << shardCount << std::endl;
+        exit(1);
+      }
+
+      if (s.queryCount != parameters.querySequences.size() || s.refCount != parameters.refSequences.size())
+      {
+        std::cerr << "ERROR, cgi::mergeShards, " << shardFiles[i] << " was computed for " << s.queryCount << " query and "
+          << s.refCount << " reference genomes, the given lists have " << parameters.querySequences.size() << " and "
+          << parameters.refSequences.size() << std::endl;
+        exit(1);
+      }
+
+      seen[s.shardId - 1] = true;
+    }
+
+    if (shards.size() != (uint64_t) shardCount)
+    {
+      std::cerr << "ERROR, cgi::mergeShards, " << shardCount - shards.size() << " of " << shardCount << " shards are missing" << std::endl;
+      exit(1);
+    }
+
+    std::cerr << "INFO, cgi::mergeShards, merging " << shardCount << " shards" << std::endl;
+
+    //Shard holding the result to output next is on top, ties go to the earlier file
+    auto outputLater = [&](uint64_t x, uint64_t y)
+    {
+      const CGI_Results &a = shards[x]->current, &b = shards[y]->current;
+      return a < b || (!(b < a) && x > y);
+    };
+
+    std::priority_queue<uint64_t, std::vector<uint64_t>, decltype(outputLater)> heap (outputLater);
+
+    for (uint64_t i = 0; i < shards.size(); i++)
+      if (shards[i]->next())
+        heap.push(i);
+
+    std::unique_ptr<PhylipMatrix> matrix;
+    if (parameters.matrixOutput)
+      matrix.reset( new PhylipMatrix(parameters.querySequences, parameters.refSequences) );
+
+    std::ofstream outstrm;
+    BinaryResults::Writer binary;
+
+    if (parameters.binaryOutput)
+      binary.open(parameters.outFileName, parameters.querySequences, parameters.refSequences);
+    else
+      outstrm.open(parameters.outFileName);
+
+    uint64_t resultCount = 0;
+
+    while (!heap.empty())
+    {
+      uint64_t i = heap.top();
+      heap.pop();
+
+      const CGI_Results &e = shards[i]->current;
+
+      if (parameters.binaryOutput)
+        binary.write(e);
+      else
+        outstrm << parameters.querySequences[e.qryGenomeId]
+          << "\t" << parameters.refSequences[e.refGenomeId]
+          << "\t" << e.identity
+          << "\t" << e.countSeq
+          << "\t" << e.totalQueryFragments
+          << "\n";
+
+      if (matrix)
+        matrix->add(e.qryGenomeId, e.refGenomeId, e.identity);
+
+      resultCount++;
+
+      if (shards[i]->next())
+        heap.push(i);
+    }
+
+    if (parameters.binaryOutput)
+      binary.close();
+    else
+      outstrm.close();
+
+    if (matrix)
+      matrix->write(parameters.outFileName + ".matrix");
+
+    std::cerr << "INFO, cgi::mergeShards, " << resultCount << " results written to " << parameters.outFileName << std::endl;
+  }
+}
+
+#endif
@@ -0,0 +1,203 @@
+/**
+ * @file    prefilter.hpp
+ * @brief   skips (query genome, reference genome) pairs which can not be reported,
+ *          using a whole-genome sample of the query minimizers, before fragments are mapped
+ */
+
+#ifndef CGI_PREFILTER_HPP
+#define CGI_PREFILTER_HPP
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+//Own includes
+#include "map/include/base_types.hpp"
+#include "map/include/map_parameters.hpp"
+#include "map/include/winSketch.hpp"
+#include "map/include/querySketch.hpp"
+
+namespace cgi
+{
+  /**
+   * @class     cgi::Prefilter
+   * @brief     selects the reference genomes a query genome is mapped against
+   * @details   A pair is reported only if enough query fragments are mapped to cover minFraction
+   *            of the shorter genome. At percentageIdentity, a fragment shares a fraction
+   *            exp(-k * (1 - identity)) of its minimizers with the reference (Mash distance, as used
+   *            for the ANI estimate), so a reference genome reported at or above the identity
+   *            threshold contains at least the product of the two fractions of the distinct
+   *            minimizers of the query genome. The query genome is summarized by the smallest
+   *            hashes of its distinct minimizers (bottom-s sample), and each reference genome is
+   *            skipped if the count of sampled minimizers it contains is too low for this bound,
+   *            with a binomial p-value below maxPValue. Pairs reported below the identity threshold
+   *            (fragments are kept on the upper bound of their identity) may be skipped as well
+   */
+  class Prefilter
+  {
+    private:
+
+      //Count of distinct minimizers sampled from each query genome
+      const uint64_t sampleSize = 16384;
+
+      //A reference genome is skipped if it is this unlikely to contain as few sampled
+      //minimizers when it can be reported
+      const double maxPValue = 1e-6;
+
+    public:
+
+      /**
+       * @brief     whole-genome summary of a query genome
+       */
+      struct QueryGenome
+      {
+        //Smallest hashes of the distinct minimizers of all fragments, ascending
+        std::vector<skch::hash_t> sample;
+
+        //Count of fragments, and of fragments with minimizers that can be mapped
+        uint64_t totalFragments = 0;
+        uint64_t mappableFragments = 0;
+
+        uint64_t genomeLength = 0;
+      };
+
+      /**
+       * @brief                       summarize a sketched query genome
+       * @param[in]   querySketch     sketch of the query genome
+       * @param[out]  query           summary
+       */
+      void sketchQuery(const skch::QuerySketch &querySketch, QueryGenome &query) const
+      {
+        std::vector<skch::hash_t> hashes;
+
+        for (auto &Q : querySketch.fragments)
+        {
+          //Fragments without minimizers are never mapped
+          if (Q.sketchSize == 0)
+            continue;
+
+          for (auto &e : Q.minimizerTableQuery)
+            hashes.push_back(e.hash);
+
+          query.mappableFragments++;
+        }
+
+        std::sort(hashes.begin(), hashes.end());
+        hashes.erase( std::unique(hashes.begin(), hashes.end()), hashes.end() );
+
+        query.sample.assign(hashes.begin(), hashes.begin() + std::min<uint64_t>(sampleSize, hashes.size()));
+        query.totalFragments = querySketch.totalQueryFragments;
+        query.genomeLength = querySketch.genomeLength;
+      }
+
+      /**
+       * @brief                       select the reference genomes of a sketch that a query genome
+       *                              may be reported with
+       * @param[in]   parameters      algorithm parameters
+       * @param[in]   query           summary of the query genome
+       * @param[in]   refSketch       sketch of a reference block
+       * @param[out]  selected        per genome of the block, true if it is to be mapped against
+       * @return                      count of selected genomes
+       */
+      uint64_t selectGenomes(const skch::Parameters &parameters, const QueryGenome &query,
+          const skch::Sketch &refSketch, std::vector<bool> &selected) const
+      {
+        uint64_t genomeCount = refSketch.sequencesByFileInfo.size();
+
+        //Count of sampled minimizers found in each genome, and the last one counted
+        std::vector<uint64_t> shared (genomeCount, 0);
+        std::vector<uint64_t> lastCounted (genomeCount, std::numeric_limits<uint64_t>::max());
+
+        for (uint64_t i = 0; i < query.sample.size(); i++)
+        {
+          skch::Sketch::MI_Range_t hits = refSketch.findHits(query.sample[i]);
+
+          for (auto it = hits.first; it != hits.second; it++)
+          {
+            uint64_t genomeId = std::distance(refSketch.sequencesByFileInfo.begin(),
+                std::upper_bound(refSketch.sequencesByFileInfo.begin(), refSketch.sequencesByFileInfo.end(), it->seqId));
+
+            if (lastCounted[genomeId] != i)
+            {
+              lastCounted[genomeId] = i;
+              shared[genomeId]++;
+            }
+          }
+        }
+
+        selected.assign(genomeCount, true);
+        uint64_t selectedCount = genomeCount;
+
+        for (uint64_t g = 0; g < genomeCount; g++)
+        {
+          if (!canBeReported(parameters, query, refSketch.genomeLengths[g], shared[g]))
+          {
+            selected[g] = false;
+            selectedCount--;
+          }
+        }
+
+        return selectedCount;
+      }
+
+    private:
+
+      /**
+       * @brief                       test if a pair may pass the reporting thresholds
+       * @param[in]   parameters      algorithm parameters
+       * @param[in]   query           summary of the query genome
+       * @param[in]   refGenomeLength
+       * @param[in]   shared          count of sampled minimizers found in the reference genome
+       */
+      bool canBeReported(const skch::Parameters &parameters, const QueryGenome &query,
+          uint64_t refGenomeLength, uint64_t shared) const
+      {
+        //Fewest mapped fragments to pass minFraction (see ResultWriter), rounded down to stay on the safe side
+        uint64_t minGenomeLength = std::min(query.genomeLength, refGenomeLength);
+        uint64_t minFragments = minGenomeLength * parameters.minFraction / parameters.minReadLength;
+
+        if (minFragments == 0 || query.sample.empty())
+          return true;
+
+        //Not enough fragments can be mapped
+        if (minFragments > query.mappableFragments)
+          return false;
+
+        double sharedFraction = std::exp(-parameters.kmerSize * (1.0 - parameters.percentageIdentity / 100.0));
+        double containment = std::min(1.0, sharedFraction * minFragments / query.totalFragments);
+
+        if (shared >= query.sample.size() * containment)
+          return true;
+
+        return binomialLowerTail(shared, query.sample.size(), containment) >= maxPValue;
+      }
+
+      /**
+       * @brief                       probability of at most x successes in n trials
+       * @param[in]   x               x < n * p
+       * @param[in]   n
+       * @param[in]   p               success probability, 0 < p <= 1
+       */
+      static double binomialLowerTail(uint64_t x, uint64_t n, double p)
+      {
+        if (p >= 1.0)
+          return 0.0;
+
+        //Terms increase up to x, sum them relative to the last one in log space
+        std::vector<double> logTerms (x + 1);
+
+        logTerms[0] = n * std::log1p(-p);
+        for (uint64_t i = 1; i <= x; i++)
+          logTerms[i] = logTerms[i-1] + std::log(1.0 * (n - i + 1) / i) + std::log(p) - std::log1p(-p);
+
+        double sum = 0.0;
+        for (auto e : logTerms)
+          sum += std::exp(e - logTerms[x]);
+
+        return std::exp(logTerms[x] + std::log(sum));
+      }
+  };
+}
+
+#endif
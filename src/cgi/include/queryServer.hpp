@@ -0,0 +1,770 @@
+/**
+ * @file    queryServer.hpp
+ * @brief   resident server that keeps a reference index loaded and maps query genomes
+ *          sent over a local Unix domain socket, and its client
+ */
+
+#ifndef CGI_QUERY_SERVER_HPP
+#define CGI_QUERY_SERVER_HPP
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <csignal>
+#include <climits>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+//Own includes
+#include "map/include/map_parameters.hpp"
+#include "map/include/base_types.hpp"
+#include "map/include/winSketch.hpp"
+#include "map/include/querySketch.hpp"
+#include "map/include/computeMap.hpp"
+#include "map/include/refIndex.hpp"
+#include "map/include/genomeReader.hpp"
+#include "cgi/include/cgid_types.hpp"
+#include "cgi/include/computeCoreIdentity.hpp"
+#include "cgi/include/resultWriter.hpp"
+
+namespace cgi
+{
+  /**
+   * @class     cgi::SocketStream
+   * @brief     buffered line and byte reads, and complete writes, on a connected socket,
+   *            optionally bounded by a deadline
+   */
+  class SocketStream
+  {
+    private:
+
+      int fd;
+      std::vector<char> buffer;
+      uint64_t begin = 0;
+      uint64_t end = 0;
+
+      //Reads and writes fail once the deadline has passed, if one is set
+      bool hasDeadline = false;
+      std::chrono::steady_clock::time_point deadline;
+
+      /**
+       * @brief     wait until the socket is ready for reading or writing
+       * @param[in] events    POLLIN or POLLOUT
+       * @return    false if the deadline passed first, or on an error
+       */
+      bool waitReady(short events)
+      {
+        if (!hasDeadline)
+          return true;
+
+        while (true)
+        {
+          auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+
+          if (remaining.count() <= 0)
+            return false;
+
+          struct pollfd p = {fd, events, 0};
+          int n = poll(&p, 1, std::min<int64_t>(remaining.count(), INT_MAX));
+
+          if (n < 0 && errno == EINTR)
+            continue;
+
+          return n > 0;
+        }
+      }
+
+      /**
+       * @brief     receive more bytes into the buffer
+       * @return    false at the end of the stream, or on an error or timeout
+       */
+      bool fill()
+      {
+        if (begin == end)
+          begin = end = 0;
+
+        if (end == buffer.size())
+          buffer.resize(std::max<uint64_t>(buffer.size() * 2, 1 << 16));
+
+        if (!waitReady(POLLIN))
+          return false;
+
+        ssize_t n;
+        do
+          n = recv(fd, buffer.data() + end, buffer.size() - end, 0);
+        while (n < 0 && errno == EINTR);
+
+        if (n <= 0)
+          return false;
+
+        end += n;
+        return true;
+      }
+
+    public:
+
+      SocketStream(int fd_) : fd(fd_) {}
+
+      /**
+       * @brief                   bound the time of the following reads and writes altogether
+       * @param[in]   seconds     time from now
+       */
+      void setTimeout(int seconds)
+      {
+        hasDeadline = true;
+        deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+      }
+
+      /**
+       * @brief                   read a line, without its new line
+       * @param[out]  line
+       * @param[in]   maxLength   longest line accepted
+       * @return                  false if no complete line could be read
+       */
+      bool readLine(std::string &line, uint64_t maxLength)
+      {
+        while (true)
+        {
+          char *first = buffer.data() + begin;
+          char *newLine = begin < end ? static_cast<char *>(memchr(first, '\n', end - begin)) : nullptr;
+
+          if (newLine != nullptr)
+          {
+            line.assign(first, newLine);
+            begin += newLine - first + 1;
+            return true;
+          }
+
+          if (end - begin > maxLength || !fill())
+            return false;
+        }
+      }
+
+      /**
+       * @brief                   read exactly count bytes
+       * @details                 data grows as bytes arrive, not up to count beforehand
+       * @param[out]  data
+       * @param[in]   count
+       * @return                  false if the stream ended first
+       */
+      bool readBytes(std::vector<char> &data, uint64_t count)
+      {
+        data.clear();
+
+        while (data.size() < count)
+        {
+          if (begin == end && !fill())
+            return false;
+
+          uint64_t n = std::min<uint64_t>(count - data.size(), end - begin);
+          data.insert(data.end(), buffer.data() + begin, buffer.data() + begin + n);
+
+          begin += n;
+        }
+
+        return true;
+      }
+
+      /**
+       * @brief                   write all of data
+       * @return                  false if the peer went away
+       */
+      bool write(const std::string &data)
+      {
+        uint64_t sent = 0;
+
+        while (sent < data.size())
+        {
+          if (!waitReady(POLLOUT))
+            return false;
+
+          //Does not block past the deadline on a peer that is not reading
+          ssize_t n = send(fd, data.data() + sent, data.size() - sent, 
+              MSG_NOSIGNAL | (hasDeadline ? MSG_DONTWAIT : 0));
+
+          if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+
+          if (n <= 0)
+            return false;
+
+          sent += n;
+        }
+
+        return true;
+      }
+  };
+
+  /**
+   * @brief               fill a Unix domain socket address
+   * @param[in]   path    socket file
+   * @param[out]  addr
+   * @return              false if the path is too long for a socket address
+   */
+  inline bool socketAddress(const std::string &path, struct sockaddr_un &addr)
+  {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(addr.sun_path))
+      return false;
+
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+  }
+
+  /**
+   * @class     cgi::QueryServer
+   * @brief     maps query genomes against a reference index loaded once, for clients
+   *            connecting to a Unix domain socket
+   * @details   Each connection carries one request, a tab delimited line:
+   *            1.  PATH <query name> <query genome file>, the file is read by the server
+   *            2.  FASTA <query name> <byte count>, followed by the plain FASTA contents
+   *            The response is a line 'OK <result count>' followed by the results in the
+   *            default output format (query name in place of the query genome), or a line
+   *            'ERROR <message>'. Connections are served by a fixed pool of worker threads.
+   *            The reference blocks of a query genome are mapped by the worker serving it
+   *            along with idle workers, which take blocks of queries being mapped before new
+   *            connections, so that a lone query uses all workers. At most maxPendingPerWorker
+   *            connections per worker wait for a worker, further clients wait in the listen backlog
+   */
+  class QueryServer
+  {
+    private:
+
+      skch::Parameters &parameters;
+      std::string socketPath;
+
+      //Reference index, sketches of its blocks point into the mapping
+      skch::RefIndex::MappedFile refIndexFile;
+      std::vector <uint64_t> refGenomeBegin;
+      std::vector <skch::Parameters> parameters_split;
+      std::vector < std::unique_ptr<skch::Sketch> > referSketches;
+      std::vector <uint64_t> refGenomeLengths;
+
+      std::unique_ptr<skch::Stat::MappingTable> statTable;
+
+      const uint64_t maxPendingPerWorker = 4;
+
+      //Longest request line, and largest query genome contents accepted (uploaded, or read from
+      //a path after decompression), well above the size of a prokaryotic genome
+      const uint64_t maxRequestLength = 1 << 16;
+      const uint64_t maxPayloadSize = 256ULL << 20;
+
+      //Connections are dropped if a request is not received, or its response not sent, within this time
+      const int requestTimeout = 60;
+
+      std::mutex mutex;
+      std::condition_variable connectionReady;
+      std::condition_variable queueFreed;
+
+      //Accepted connections waiting for a worker
+      std::deque<int> pending;
+
+      /**
+       * Query genome being mapped against the reference blocks, one block at a time
+       * by the worker serving it and by idle workers
+       */
+      struct MappingJob
+      {
+        const skch::QuerySketch *querySketch;
+
+        //Next block to map, and count of blocks mapped
+        uint64_t nextBlock = 0;
+        uint64_t mappedBlocks = 0;
+
+        //Results of each block, with global genome ids
+        std::vector< std::vector<CGI_Results> > blockResults;
+
+        std::condition_variable blocksMapped;
+      };
+
+      //Jobs with blocks left to map
+      std::deque<MappingJob *> mappingJobs;
+
+      std::vector<std::thread> workers;
+
+    public:
+
+      /**
+       * @brief                     load the reference index
+       * @param[in] parameters_     parameters of the index, minFraction and worker count (threads)
+       * @param[in] socketPath_     socket file to listen on
+       */
+      QueryServer(skch::Parameters &parameters_, const std::string &socketPath_) :
+        parameters(parameters_),
+        socketPath(socketPath_)
+      {
+        refIndexFile.open(parameters.refIndex, parameters.refSequences.size());
+        refIndexFile.getPartitionGenomeBegin(refGenomeBegin);
+
+        cgi::splitReferenceGenomes (parameters, refGenomeBegin, parameters_split);
+
+        refGenomeLengths.resize(parameters.refSequences.size());
+
+        for (uint64_t b = 0; b < parameters_split.size(); b++)
+        {
+          referSketches.emplace_back( new skch::Sketch(refIndexFile.loadPartition(parameters_split[b], b)) );
+
+          for (uint64_t j = 0; j < parameters_split[b].refSequences.size(); j++)
+            refGenomeLengths[refGenomeBegin[b] + j] = referSketches[b]->genomeLengths[j];
+        }
+
+        statTable.reset( new skch::Stat::MappingTable(parameters.kmerSize, parameters.percentageIdentity, parameters.minReadLength) );
+
+        std::cerr << "INFO, cgi::QueryServer, loaded " << parameters.refSequences.size() << " reference genomes in "
+          << parameters_split.size() << " blocks from " << parameters.refIndex << std::endl;
+      }
+
+      QueryServer(const QueryServer &) = delete;
+      QueryServer & operator=(const QueryServer &) = delete;
+
+      /**
+       * @brief     listen on the socket and serve clients, until the process is terminated
+       */
+      void run()
+      {
+        int listenFd = listenSocket();
+
+        for (int i = 0; i < parameters.threads; i++)
+          workers.emplace_back(&QueryServer::work, this);
+
+        std::cerr << "INFO, cgi::QueryServer, listening on " << socketPath << " with " << parameters.threads << " workers" << std::endl;
+
+        while (true)
+        {
+          int fd = accept(listenFd, nullptr, nullptr);
+
+          if (fd < 0)
+          {
+            if (errno == EINTR || errno == ECONNABORTED)
+              continue;
+
+            std::cerr << "ERROR, cgi::QueryServer::run, accept failed: " << strerror(errno) << std::endl;
+            exit(1);
+          }
+
+          std::unique_lock<std::mutex> lock(mutex);
+          queueFreed.wait(lock, [&] { return pending.size() < maxPendingPerWorker * parameters.threads; });
+
+          pending.push_back(fd);
+          connectionReady.notify_one();
+        }
+      }
+
+    private:
+
+      //Socket file removed when the server is terminated
+      static char *socketFile()
+      {
+        static char path[sizeof(sockaddr_un::sun_path)] = {};
+        return path;
+      }
+
+      static void removeSocketAndExit(int)
+      {
+        unlink(socketFile());
+        _exit(0);
+      }
+
+      /**
+       * @brief     bind and listen on the socket file, replacing a stale one left by
+       *            a server that is not running anymore
+       * @return    listening socket
+       */
+      int listenSocket()
+      {
+        struct sockaddr_un addr;
+
+        if (!socketAddress(socketPath, addr))
+        {
+          std::cerr << "ERROR, cgi::QueryServer, socket path " << socketPath << " is too long" << std::endl;
+          exit(1);
+        }
+
+        struct stat st;
+        if (lstat(socketPath.c_str(), &st) == 0)
+        {
+          int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+          bool listening = connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+          close(probe);
+
+          if (!S_ISSOCK(st.st_mode) || listening)
+          {
+            std::cerr << "ERROR, cgi::QueryServer, " << socketPath
+              << (listening ? " is used by a running server" : " exists and is not a socket") << std::endl;
+            exit(1);
+          }
+
+          unlink(socketPath.c_str());
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+            listen(fd, maxPendingPerWorker * parameters.threads) != 0)
+        {
+          std::cerr << "ERROR, cgi::QueryServer, Could not listen on " << socketPath << ": " << strerror(errno) << std::endl;
+          exit(1);
+        }
+
+        strcpy(socketFile(), socketPath.c_str());
+        signal(SIGINT, removeSocketAndExit);
+        signal(SIGTERM, removeSocketAndExit);
+
+        //Clients going away must not terminate the server
+        signal(SIGPIPE, SIG_IGN);
+
+        return fd;
+      }
+
+      /**
+       * @brief     worker thread, maps blocks of queries being mapped, 
+       *            or else serves pending connections one at a time
+       */
+      void work()
+      {
+        while (true)
+        {
+          int fd = -1;
+          MappingJob *job = nullptr;
+          uint64_t b = 0;
+
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            connectionReady.wait(lock, [&] { return !mappingJobs.empty() || !pending.empty(); });
+
+            if (!mappingJobs.empty())
+            {
+              job = mappingJobs.front();
+              b = claimBlock(*job);
+            }
+            else
+            {
+              fd = pending.front();
+              pending.pop_front();
+              queueFreed.notify_one();
+            }
+          }
+
+          if (job != nullptr)
+            mapBlock(*job, b);
+          else
+          {
+            serve(fd);
+            close(fd);
+          }
+        }
+      }
+
+      /**
+       * @brief               read a request, map the query genome and reply with its results
+       * @param[in]   fd      connected socket
+       */
+      void serve(int fd)
+      {
+        auto t0 = skch::Time::now();
+
+        SocketStream conn(fd);
+        std::string line;
+
+        //Whole request, however slowly it trickles in
+        conn.setTimeout(requestTimeout);
+
+        if (!conn.readLine(line, maxRequestLength))
+        {
+          conn.write("ERROR request line is missing or too long\n");
+          return;
+        }
+
+        std::vector<std::string> fields;
+        std::istringstream request(line);
+        std::string field;
+
+        while (std::getline(request, field, '\t'))
+          fields.push_back(field);
+
+        skch::ParsedGenome genome;
+
+        if (fields.size() == 3 && fields[0] == "PATH")
+        {
+          //Devices and endless inputs would hold the worker, as would huge files
+          struct stat st;
+
+          if (stat(fields[2].c_str(), &st) != 0 || !S_ISREG(st.st_mode) || std::ifstream(fields[2]).fail())
+          {
+            conn.write("ERROR could not open " + fields[2] + " as a regular file\n");
+            return;
+          }
+
+          if ((uint64_t) st.st_size > maxPayloadSize || !genome.read(fields[2], maxPayloadSize))
+          {
+            conn.write("ERROR " + fields[2] + " is larger than " + std::to_string(maxPayloadSize) + " bytes\n");
+            return;
+          }
+        }
+        else if (fields.size() == 3 && fields[0] == "FASTA")
+        {
+          char *last = nullptr;
+          uint64_t size = strtoull(fields[2].c_str(), &last, 10);
+
+          if (fields[2].empty() || *last != '\0' || size > maxPayloadSize)
+          {
+            conn.write("ERROR invalid FASTA size " + fields[2] + "\n");
+            return;
+          }
+
+          std::vector<char> data;
+
+          if (!conn.readBytes(data, size))
+          {
+            conn.write("ERROR contents of " + fields[1] + " are truncated\n");
+            return;
+          }
+
+          if (!genome.readBuffer(std::move(data)))
+          {
+            conn.write("ERROR contents of " + fields[1] + " are not plain FASTA\n");
+            return;
+          }
+        }
+        else
+        {
+          conn.write("ERROR malformed request\n");
+          return;
+        }
+
+        skch::QuerySketch querySketch;
+        querySketch.build(parameters, genome);
+
+        std::vector<CGI_Results> results;
+        mapQuery(querySketch, results);
+
+        selectReported(parameters, querySketch.genomeLength, refGenomeLengths, results);
+
+        std::ostringstream reply;
+        reply << "OK " << results.size() << "\n";
+
+        for (auto &e : results)
+          reply << fields[1]
+            << "\t" << parameters.refSequences[e.refGenomeId]
+            << "\t" << e.identity
+            << "\t" << e.countSeq
+            << "\t" << e.totalQueryFragments
+            << "\n";
+
+        conn.setTimeout(requestTimeout);
+        conn.write(reply.str());
+
+        std::chrono::duration<double> timeQuery = skch::Time::now() - t0;
+        std::cerr << "INFO, cgi::QueryServer, " << fields[1] << " : " << results.size() << " results in "
+          << timeQuery.count() << " sec" << std::endl;
+      }
+
+      /**
+       * @brief                       map a query genome against all reference blocks,
+       *                              along with idle workers
+       * @param[in]   querySketch
+       * @param[out]  results         results against all reference genomes
+       */
+      void mapQuery(const skch::QuerySketch &querySketch, std::vector<CGI_Results> &results)
+      {
+        MappingJob job;
+        job.querySketch = &querySketch;
+        job.blockResults.resize(referSketches.size());
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          mappingJobs.push_back(&job);
+        }
+
+        connectionReady.notify_all();
+
+        while (true)
+        {
+          uint64_t b;
+
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (job.nextBlock == referSketches.size())
+              break;
+
+            b = claimBlock(job);
+          }
+
+          mapBlock(job, b);
+        }
+
+        //Blocks taken by other workers
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          job.blocksMapped.wait(lock, [&] { return job.mappedBlocks == referSketches.size(); });
+        }
+
+        for (auto &e : job.blockResults)
+          results.insert(results.end(), e.begin(), e.end());
+      }
+
+      /**
+       * @brief                       take the next block of a job, called with mutex held
+       * @return                      block id
+       */
+      uint64_t claimBlock(MappingJob &job)
+      {
+        uint64_t b = job.nextBlock++;
+
+        if (job.nextBlock == referSketches.size())
+          mappingJobs.erase( std::find(mappingJobs.begin(), mappingJobs.end(), &job) );
+
+        return b;
+      }
+
+      /**
+       * @brief                       map the query genome of a job against a reference block
+       * @param[in]   job
+       * @param[in]   b               block id, claimed by claimBlock()
+       */
+      void mapBlock(MappingJob &job, uint64_t b)
+      {
+        //Used for visualization only
+        std::string fileName;
+
+        skch::MappingResultsVector_t mapResults;
+
+        auto fn = std::bind(skch::Map::insertL2ResultsToVec, std::ref(mapResults), std::placeholders::_1);
+        skch::Map mapper = skch::Map(parameters_split[b], *referSketches[b], *statTable, *job.querySketch, fn);
+
+        cgi::computeCGI(parameters_split[b], mapResults, *job.querySketch, *referSketches[b], 0, fileName, job.blockResults[b]);
+        cgi::correctRefGenomeIds (job.blockResults[b], refGenomeBegin[b]);
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (++job.mappedBlocks == referSketches.size())
+          job.blocksMapped.notify_one();
+      }
+  };
+
+  /**
+   * @brief                       send query genomes to a running 'fastANI serve', and write
+   *                              their results in the default output format
+   * @param[in]   socketPath      socket of the server
+   * @param[in]   querySequences  query genome files
+   * @param[in]   upload          send the genome contents instead of their paths, any input
+   *                              format is converted to plain FASTA here
+   * @param[in]   outFileName     output file, standard output if empty
+   */
+  inline void queryServer(const std::string &socketPath, const std::vector<std::string> &querySequences,
+      bool upload, const std::string &outFileName)
+  {
+    struct sockaddr_un addr;
+
+    if (!socketAddress(socketPath, addr))
+    {
+      std::cerr << "ERROR, cgi::queryServer, socket path " << socketPath << " is too long" << std::endl;
+      exit(1);
+    }
+
+    std::ofstream outFile;
+    if (outFileName != "")
+      outFile.open(outFileName);
+
+    std::ostream &outstrm = outFileName != "" ? outFile : std::cout;
+
+    for (auto &query : querySequences)
+    {
+      std::string request;
+      std::vector<char> contents;
+
+      if (upload)
+      {
+        //Sent as plain FASTA, whatever the input format
+        skch::ParsedGenome genome;
+        genome.read(query);
+
+        for (auto &record : genome.records)
+        {
+          contents.push_back('>');
+          contents.insert(contents.end(), record.name.s, record.name.s + record.name.l);
+          contents.push_back('\n');
+          contents.insert(contents.end(), record.seq.s, record.seq.s + record.seq.l);
+          contents.push_back('\n');
+        }
+
+        request = "FASTA\t" + query + "\t" + std::to_string(contents.size()) + "\n";
+      }
+      else
+      {
+        //Server may run in another directory
+        char path[PATH_MAX];
+
+        if (realpath(query.c_str(), path) == nullptr)
+        {
+          std::cerr << "ERROR, cgi::queryServer, Could not open " << query << std::endl;
+          exit(1);
+        }
+
+        request = "PATH\t" + query + "\t" + path + "\n";
+      }
+
+      request.append(contents.begin(), contents.end());
+
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+      if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+      {
+        std::cerr << "ERROR, cgi::queryServer, Could not connect to " << socketPath << ", is 'fastANI serve' running?" << std::endl;
+        exit(1);
+      }
+
+      SocketStream conn(fd);
+      std::string status, line;
+
+      if (!conn.write(request) || !conn.readLine(status, ULLONG_MAX))
+      {
+        std::cerr << "ERROR, cgi::queryServer, server closed the connection while serving " << query << std::endl;
+        exit(1);
+      }
+
+      if (status.compare(0, 3, "OK ") != 0)
+      {
+        std::cerr << "ERROR, cgi::queryServer, " << query << " : " << status << std::endl;
+        exit(1);
+      }
+
+      uint64_t resultCount = strtoull(status.c_str() + 3, nullptr, 10);
+
+      for (uint64_t i = 0; i < resultCount; i++)
+      {
+        if (!conn.readLine(line, ULLONG_MAX))
+        {
+          std::cerr << "ERROR, cgi::queryServer, server closed the connection while serving " << query << std::endl;
+          exit(1);
+        }
+
+        outstrm << line << "\n";
+      }
+
+      close(fd);
+    }
+
+    outstrm.flush();
+  }
+}
+
+#endif
@@ -0,0 +1,276 @@
+/**
+ * @file    resultWriter.hpp
+ * @brief   writes the results of each query genome as soon as it is complete, on a dedicated thread
+ */
+
+#ifndef CGI_RESULT_WRITER_HPP
+#define CGI_RESULT_WRITER_HPP
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <limits>
+
+//Own includes
+#include "map/include/map_parameters.hpp"
+#include "cgi/include/cgid_types.hpp"
+#include "cgi/include/computeCoreIdentity.hpp"
+#include "cgi/include/binaryResults.hpp"
+
+namespace cgi
+{
+  /**
+   * @brief                         sort results of a query genome in output order, decreasing
+   *                                ANI value, and keep genome pairs sharing at least minFraction
+   *                                of the shorter genome
+   * @param[in]     parameters      algorithm parameters
+   * @param[in]     queryGenomeLength
+   * @param[in]     refGenomeLengths  length of each reference genome
+   * @param[in/out] results         results of the query genome against all reference genomes
+   */
+  inline void selectReported(const skch::Parameters &parameters, uint64_t queryGenomeLength,
+      const std::vector<uint64_t> &refGenomeLengths, std::vector<CGI_Results> &results)
+  {
+    //sort result by identity
+    std::sort(results.rbegin(), results.rend());
+
+    results.erase( std::remove_if(results.begin(), results.end(), [&](const CGI_Results &e)
+          {
+            uint64_t refGenomeLength = refGenomeLengths[e.refGenomeId];
+            uint64_t minGenomeLength = std::min(queryGenomeLength, refGenomeLength);
+            uint64_t sharedLength = e.countSeq * parameters.minReadLength;
+
+            //Checking if shared genome is above a certain fraction of genome length
+            return sharedLength < minGenomeLength * parameters.minFraction;
+          }), results.end());
+  }
+
+  /**
+   * @class     cgi::ResultWriter
+   * @brief     writes FastANI results per query genome, in increasing order of query genome id,
+   *            and in decreasing order of ANI value for each query genome
+   * @details   Results of a query genome are submitted once it is mapped against all reference
+   *            blocks, and wait until the results of all query genomes before it are written.
+   *            Output is flushed whenever the writer runs out of results to write, so that
+   *            output may be consumed while the run goes on. Output formats:
+   *            1.  default: tab delimited query genome, reference genome, ANI value, count of
+   *                bidirectional fragment mappings, and total query fragments
+   *            2.  shard of a run: a header line '#fastANI-shard', shard id, shard count, count
+   *                of query and reference genomes of the full lists. Then the same columns, with
+   *                query and reference genome ids (0-based positions in the full lists) instead
+   *                of genome names, and ANI values with full float precision
+   *            3.  binary: see BinaryResults
+   *            Only genome pairs sharing at least minFraction of the shorter genome are written.
+   *            These are also added to the lower triangular matrix if --matrix is used
+   */
+  class ResultWriter
+  {
+    private:
+
+      const skch::Parameters &parameters;
+
+      //Genome ranges of the shard, null if the run is not sharded
+      const Shard *shard;
+
+      //Length of each reference genome, by reference genome id
+      std::vector<uint64_t> refGenomeLengths;
+
+      std::string fileName;
+      std::ofstream outstrm;
+      std::unique_ptr<BinaryResults::Writer> binary;
+      std::unique_ptr<PhylipMatrix> matrix;
+
+      std::mutex mutex;
+      std::condition_variable resultsReady;
+
+      //Submitted query genomes waiting to be written, by query genome id: length, results
+      std::map< uint64_t, std::pair< uint64_t, std::vector<CGI_Results> > > submitted;
+
+      //Query genome to write next
+      uint64_t nextQuery = 0;
+      bool finishing = false;
+
+      std::thread writer;
+
+    public:
+
+      /**
+       * @brief                         open the output and start the writer thread
+       * @param[in] parameters_         algorithm parameters, genome lists of the run
+       * @param[in] refGenomeLengths_   length of each reference genome
+       * @param[in] shard_              genome ranges of the shard, null if not sharded
+       * @param[in] fileName_           output file name
+       */
+      ResultWriter(const skch::Parameters &parameters_, const std::vector<uint64_t> &refGenomeLengths_,
+          const Shard *shard_, const std::string &fileName_) :
+        parameters(parameters_),
+        shard(shard_),
+        refGenomeLengths(refGenomeLengths_),
+        fileName(fileName_)
+      {
+        if (parameters.binaryOutput)
+        {
+          binary.reset( new BinaryResults::Writer() );
+          binary->open(fileName, parameters.querySequences, parameters.refSequences);
+        }
+        else
+          outstrm.open(fileName);
+
+        if (shard != nullptr)
+        {
+          outstrm.precision(std::numeric_limits<float>::max_digits10);
+
+          outstrm << "#fastANI-shard"
+            << "\t" << parameters.shardId
+            << "\t" << parameters.shardCount
+            << "\t" << shard->queryCount
+            << "\t" << shard->refCount
+            << "\n";
+        }
+
+        if (parameters.matrixOutput)
+          matrix.reset( new PhylipMatrix(parameters.querySequences, parameters.refSequences) );
+
+        writer = std::thread(&ResultWriter::writeInOrder, this);
+      }
+
+      ResultWriter(const ResultWriter &) = delete;
+      ResultWriter & operator=(const ResultWriter &) = delete;
+
+      ~ResultWriter()
+      {
+        if (writer.joinable())
+          finish();
+      }
+
+      /**
+       * @brief                         submit all results of a query genome
+       * @param[in] queryGenomeId
+       * @param[in] queryGenomeLength
+       * @param[in] results             results of the query genome against all reference genomes
+       */
+      void submit(uint64_t queryGenomeId, uint64_t queryGenomeLength, std::vector<CGI_Results> &&results)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        submitted[queryGenomeId] = std::make_pair(queryGenomeLength, std::move(results));
+
+        if (queryGenomeId == nextQuery)
+          resultsReady.notify_one();
+      }
+
+      /**
+       * @brief     write the remaining results, stop the writer thread, and write the matrix
+       */
+      void finish()
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          finishing = true;
+        }
+
+        resultsReady.notify_one();
+        writer.join();
+
+        if (nextQuery != parameters.querySequences.size())
+        {
+          std::cerr << "ERROR, cgi::ResultWriter::finish, results of query genome #" << nextQuery + 1
+            << " were not submitted" << std::endl;
+          exit(1);
+        }
+
+        if (binary)
+          binary->close();
+        else
+          outstrm.close();
+
+        if (matrix)
+          matrix->write(fileName + ".matrix");
+      }
+
+    private:
+
+      /**
+       * @brief     writer thread, writes submitted query genomes in order of their ids
+       */
+      void writeInOrder()
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+          auto it = submitted.find(nextQuery);
+
+          if (it == submitted.end())
+          {
+            if (finishing)
+              return;
+
+            //Nothing to write until the next query genome completes
+            lock.unlock();
+            outstrm.flush();
+            lock.lock();
+
+            resultsReady.wait(lock, [&] { return finishing || submitted.count(nextQuery) > 0; });
+            continue;
+          }
+
+          std::pair< uint64_t, std::vector<CGI_Results> > query = std::move(it->second);
+          submitted.erase(it);
+          lock.unlock();
+
+          write(query.first, query.second);
+
+          lock.lock();
+          nextQuery++;
+        }
+      }
+
+      /**
+       * @brief                         write results of a query genome
+       * @param[in] queryGenomeLength
+       * @param[in] results
+       */
+      void write(uint64_t queryGenomeLength, std::vector<CGI_Results> &results)
+      {
+        selectReported(parameters, queryGenomeLength, refGenomeLengths, results);
+
+        //Genome ids of a shard are written as positions in the full lists,
+        //reference genome ids of an index run are already global
+        uint64_t queryOffset = shard != nullptr ? shard->queryBegin : 0;
+        uint64_t refOffset = shard != nullptr && parameters.refIndex == "" ? shard->refBegin : 0;
+
+        for(auto &e : results)
+        {
+          if (matrix)
+            matrix->add(e.qryGenomeId, e.refGenomeId, e.identity);
+
+          if (binary)
+          {
+            binary->write(e);
+            continue;
+          }
+
+          if (shard != nullptr)
+            outstrm << queryOffset + e.qryGenomeId
+              << "\t" << refOffset + e.refGenomeId;
+          else
+            outstrm << parameters.querySequences[e.qryGenomeId]
+              << "\t" << parameters.refSequences[e.refGenomeId];
+
+          outstrm << "\t" << e.identity
+            << "\t" << e.countSeq
+            << "\t" << e.totalQueryFragments
+            << "\n";
+        }
+      }
+  };
+}
+
+#endif
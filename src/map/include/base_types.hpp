@@ -76,13 +76,13 @@ namespace skch
   };
 
   //Information about query sequence during L1/L2 mapping
-  template <typename KSEQ, typename MinimizerVec>
+  template <typename MinimizerVec>
     struct QueryMetaData
     {
-      KSEQ kseq;                          //query sequence object pointer (kseq library) 
+      offset_t len;                       //query sequence length
       seqno_t seqCounter;                 //query sequence counter
       int sketchSize;                     //sketch size
-      MinimizerVec minimizerTableQuery;   //Vector of minimizers in the query 
+      MinimizerVec minimizerTableQuery;   //Vector of minimizers in the query, unique and sorted by hash
     };
 
   //Final mapping result
@@ -8,12 +8,12 @@
 
 #include <vector>
 #include <algorithm>
-#include <deque>
 #include <cmath>
 #include <fstream>
 
 //Own includes
 #include "map/include/map_parameters.hpp"
+#include "map/include/hashBatch.hpp"
 
 //External includes
 #include "common/murmur3.h"
@@ -31,6 +31,9 @@ namespace skch
     //seed for murmerhash
     const int seed = 42;
 
+    //Count of kmers hashed together by addMinimizers()
+    const int hashBlockSize = 256;
+
     /**
      * @brief   reverse complement of kmer (borrowed from mash)
      */
@@ -80,90 +83,259 @@ namespace skch
       return hash;
     }
 
+    /**
+     * @brief   2-bit encoding of nucleotides, 4 for anything other than A, C, G, T
+     *          (upper or lower case)
+     */
+    const uint8_t nucleotideCode[256] = {
+      4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+      4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+      4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,  4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+      4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,  4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+      4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+      4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+      4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+      4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+    };
+
+    /**
+     * @brief   invertible mix of a 2-bit packed kmer (finalizer of murmur3),
+     *          distinct kmers (k <= 16) never collide
+     */
+    inline hash_t mixPackedKmer(uint32_t kmer)
+    {
+      kmer ^= kmer >> 16;
+      kmer *= 0x85ebca6b;
+      kmer ^= kmer >> 13;
+      kmer *= 0xc2b2ae35;
+      kmer ^= kmer >> 16;
+
+      return kmer;
+    }
+
+    /**
+     * @brief   reverse complement of src[0 .. length-1], without reversing 
+     *          the order of bases, i.e. dest[i] is the complement of src[-i]
+     *          Used to fill the reverse complement of a block of sequence
+     */
+    inline void complementBackward(const char * src, char * dest, int length)
+    {
+      for ( int i = 0; i < length; i++ )
+      {
+        char base = src[-i];
+
+        switch ( base )
+        {
+          case 'A': base = 'T'; break;
+          case 'C': base = 'G'; break;
+          case 'G': base = 'C'; break;
+          case 'T': base = 'A'; break;
+          default: break;
+        }
+
+        dest[i] = base;
+      }
+    }
+
+    /**
+     * @class       skch::CommonFunc::MinimizerWindow
+     * @brief       sliding window minimum over kmer hashes, kept in a fixed capacity ring buffer 
+     *              with minimum at front end. Saves hash and position of kmers, 
+     *              both increasing from front to back
+     *              Position of kmer is required to discard kmers that fall out of current window
+     */
+    class MinimizerWindow
+    {
+      private:
+
+        std::vector<hash_t> hashes;
+        std::vector<offset_t> positions;
+
+        //Capacity - 1, capacity is a power of 2
+        uint32_t mask = 0;
+
+        //Entries are saved at [head, tail), modulo capacity
+        uint32_t head = 0, tail = 0;
+
+        //Position of the kmer saved to index last, -1 if none
+        offset_t lastSavedPos = -1;
+
+      public:
+
+        /**
+         * @brief       clear the window, and reserve space for a window of given size
+         */
+        void reset(int windowSize)
+        {
+          uint32_t capacity = 1;
+          while (capacity < (uint32_t) windowSize)
+            capacity <<= 1;
+
+          if (hashes.size() < capacity)
+          {
+            hashes.resize(capacity);
+            positions.resize(capacity);
+          }
+
+          mask = capacity - 1;
+          head = tail = 0;
+          lastSavedPos = -1;
+        }
+
+        /**
+         * @brief       add a hashed kmer to the sliding window, and save the window minimizer
+         *              to the index if we are seeing it for first time
+         * @param[out]  minimizerIndex
+         * @param[in]   i               kmer position
+         * @param[in]   currentKmer     canonical kmer hash
+         * @param[in]   windowSize
+         * @param[in]   seqCounter
+         */
+        template <typename T>
+          inline void insert(std::vector<T> &minimizerIndex,
+              offset_t i, hash_t currentKmer,
+              int windowSize,
+              seqno_t seqCounter)
+          {
+            //The serial number of current sliding window
+            //First valid window appears when i = windowSize - 1
+            offset_t currentWindowId = i - windowSize + 1;
+
+            //If front minimum is not in the current window, remove it
+            while(head != tail && positions[head & mask] <= i - windowSize)
+              head++;
+
+            //Hashes less than equal to currentKmer are not required
+            //Remove them from back
+            while(head != tail && hashes[(tail - 1) & mask] >= currentKmer)
+              tail--;
+
+            //Push currentKmer and position to back
+            //Window holds kmers at positions i - windowSize + 1 .. i only, so it never overflows
+            hashes[tail & mask] = currentKmer;
+            positions[tail & mask] = i;
+            tail++;
+
+            //Select the minimizer from front and put into index
+            //We save the minimizer if we are seeing it for first time
+            if(currentWindowId >= 0 && positions[head & mask] != lastSavedPos)
+            {
+              lastSavedPos = positions[head & mask];
+              minimizerIndex.push_back( MinimizerInfo{hashes[head & mask], seqCounter, currentWindowId} );
+            }
+          }
+    };
+
     /**
      * @brief       compute winnowed minimizers from a given sequence and add to the index
      * @param[out]  minimizerIndex  minimizer table storing minimizers and their position as we compute them
      * @param[in]   seq             kseq fasta/q parser
      * @param[in]   kmerSize
      * @param[in]   windowSize
+     * @param[in]   rollingHash     hash 2-bit packed canonical kmers, maintained incrementally,
+     *                              instead of murmur3 hash of kmer strings. Kmers containing 
+     *                              non-ACGT characters are skipped. Used for nucleotides only
      * @param[in]   seqCounter      current sequence number, used while saving the position of minimizer
      */
     template <typename T, typename KSEQ>
       inline void addMinimizers(std::vector<T> &minimizerIndex, KSEQ kseq, int kmerSize, 
           int windowSize,
           int alphabetSize,
+          bool rollingHash,
           seqno_t seqCounter)
       {
-        /**
-         * Double-ended queue (saves minimum at front end)
-         * Saves pair of the minimizer and the position of hashed kmer in the sequence
-         * Position of kmer is required to discard kmers that fall out of current window
-         */
-        std::deque< std::pair<MinimizerInfo, offset_t> > Q;
+        //Window and reverse complement buffers are reused by each thread
+        static thread_local MinimizerWindow window;
+        static thread_local std::vector<char> blockRev;
 
-        makeUpperCase(kseq);
+        window.reset(windowSize);
 
         //length of the sequencd
         offset_t len = kseq->seq.l;
 
-        //Compute reverse complement of seq
-        char *seqRev = new char[len];
+        if(rollingHash && alphabetSize == 4)
+        {
+          const uint8_t *seq = reinterpret_cast<const uint8_t *>(kseq->seq.s);
+
+          //Forward and reverse complement kmers ending at current base, 2 bits per base
+          uint32_t kmerFwd = 0, kmerRev = 0;
+          uint32_t mask = kmerSize < 16 ? (1U << (2 * kmerSize)) - 1 : ~0U;
+          int shiftRev = 2 * (kmerSize - 1);
+
+          //Count of valid bases since the last non-ACGT character
+          int validBases = 0;
+
+          for(offset_t j = 0; j < len; j++)
+          {
+            uint32_t c = nucleotideCode[seq[j]];
+
+            if(c > 3)
+            {
+              validBases = 0;
+              continue;
+            }
 
-        if(alphabetSize == 4) //not protein
-          CommonFunc::reverseComplement(kseq->seq.s, seqRev, len);
+            kmerFwd = ((kmerFwd << 2) | c) & mask;
+            kmerRev = (kmerRev >> 2) | ((3 - c) << shiftRev);
 
-        for(offset_t i = 0; i < len - kmerSize + 1; i++)
+            //Consider non-symmetric kmers only
+            if(++validBases >= kmerSize && kmerFwd != kmerRev)
+              window.insert(minimizerIndex, j - kmerSize + 1, 
+                  mixPackedKmer(std::min(kmerFwd, kmerRev)), windowSize, seqCounter);
+          }
+
+          return;
+        }
+
+        makeUpperCase(kseq);
+
+        //Kmers are hashed in blocks, several kmers per instruction
+        hash_t hashesFwd[hashBlockSize];
+        hash_t hashesBwd[hashBlockSize];
+
+        //Reverse complement of a block, padded so that vector loads of the last kmers stay in bounds
+        const int blockRevPadding = 32;
+        blockRev.resize(hashBlockSize + kmerSize - 1 + blockRevPadding);
+
+        offset_t kmerCount = len - kmerSize + 1;
+
+        for(offset_t blockBegin = 0; blockBegin < kmerCount; blockBegin += hashBlockSize)
         {
-          //The serial number of current sliding window
-          //First valid window appears when i = windowSize - 1
-          offset_t currentWindowId = i - windowSize + 1;
+          int blockSize = std::min<offset_t>(hashBlockSize, kmerCount - blockBegin);
 
-          //Hash kmers
-          hash_t hashFwd = CommonFunc::getHash(kseq->seq.s + i, kmerSize); 
-          hash_t hashBwd;
+          HashBatch::getHashes(kseq->seq.s + blockBegin, len - blockBegin, kmerSize, seed, blockSize, hashesFwd);
 
+          //Reverse complement of kmer blockBegin + j starts at blockRev + blockSize - 1 - j,
+          //so hashes of the block are computed in reverse order
           if(alphabetSize == 4)
-            hashBwd = CommonFunc::getHash(seqRev + len - i - kmerSize, kmerSize);
-          else  //proteins
-            hashBwd = std::numeric_limits<hash_t>::max();   //Pick a dummy high value so that it is ignored later
+          {
+            int blockLen = blockSize + kmerSize - 1;
+            complementBackward(kseq->seq.s + blockBegin + blockLen - 1, blockRev.data(), blockLen);
+            HashBatch::getHashes(blockRev.data(), blockLen + blockRevPadding, kmerSize, seed, blockSize, hashesBwd);
+          }
 
-          //Consider non-symmetric kmers only
-          if(hashBwd != hashFwd)
+          for(int j = 0; j < blockSize; j++)
           {
-            //Take minimum value of kmer and its reverse complement
-            hash_t currentKmer = std::min(hashFwd, hashBwd);
+            offset_t i = blockBegin + j;
 
-            //If front minimum is not in the current window, remove it
-            while(!Q.empty() && Q.front().second <=  i - windowSize)
-              Q.pop_front();
+            hash_t hashFwd = hashesFwd[j];
+            hash_t hashBwd;
 
-            //Hashes less than equal to currentKmer are not required
-            //Remove them from Q (back)
-            while(!Q.empty() && Q.back().first.hash >= currentKmer) 
-              Q.pop_back();
-
-            //Push currentKmer and position to back of the queue
-            //-1 indicates the dummy window # (will be updated later)
-            Q.push_back( std::make_pair(
-                  MinimizerInfo{currentKmer, seqCounter, -1},
-                  i)); 
-
-            //Select the minimizer from Q and put into index
-            if(currentWindowId >= 0)
+            if(alphabetSize == 4)
+              hashBwd = hashesBwd[blockSize - 1 - j];
+            else  //proteins
+              hashBwd = std::numeric_limits<hash_t>::max();   //Pick a dummy high value so that it is ignored later
+
+            //Consider non-symmetric kmers only
+            if(hashBwd != hashFwd)
             {
-              //We save the minimizer if we are seeing it for first time
-              if(minimizerIndex.empty() || minimizerIndex.back() != Q.front().first)
-              {
-                //Update the window position in this minimizer
-                //This step also ensures we don't re-insert the same minimizer again
-                Q.front().first.wpos = currentWindowId;     
-                minimizerIndex.push_back(Q.front().first);
-              }
+              //Take minimum value of kmer and its reverse complement
+              hash_t currentKmer = std::min(hashFwd, hashBwd);
+
+              window.insert(minimizerIndex, i, currentKmer, windowSize, seqCounter);
             }
           }
         }
-
-        delete [] seqRev;
       }
 
     /**
@@ -172,9 +344,10 @@ namespace skch
     template <typename T, typename KSEQ>
       inline void addMinimizers(std::vector<T> &minimizerIndex, KSEQ kseq, int kmerSize,
           int windowSize, 
-          int alphabetSize)
+          int alphabetSize,
+          bool rollingHash)
       {
-        addMinimizers(minimizerIndex, kseq, kmerSize, windowSize, alphabetSize, 0);
+        addMinimizers(minimizerIndex, kseq, kmerSize, windowSize, alphabetSize, rollingHash, 0);
       }
 
    /**
@@ -215,6 +388,52 @@ namespace skch
     }
 
 
+    /**
+     * @brief               write a plain-old-data value to binary stream
+     * @param[in]   out
+     * @param[in]   val
+     */
+    template <typename T>
+      inline void writePod(std::ostream &out, const T &val)
+      {
+        out.write(reinterpret_cast<const char *>(&val), sizeof(T));
+      }
+
+    /**
+     * @brief               read a plain-old-data value from binary stream
+     * @param[in]   in
+     * @param[out]  val
+     */
+    template <typename T>
+      inline void readPod(std::istream &in, T &val)
+      {
+        in.read(reinterpret_cast<char *>(&val), sizeof(T));
+      }
+
+    /**
+     * @brief               write a string to binary stream, prefixed with its length
+     */
+    inline void writeString(std::ostream &out, const std::string &s)
+    {
+      writePod<uint32_t>(out, s.size());
+      out.write(s.data(), s.size());
+    }
+
+    /**
+     * @brief               read a string written by writeString()
+     */
+    inline void readString(std::istream &in, std::string &s)
+    {
+      uint32_t size = 0;
+      readPod(in, size);
+
+      if(!in)
+        return;
+
+      s.resize(size);
+      in.read(&s[0], size);
+    }
+
     /**
      * @brief               trim white spaces from start of the string
      * @param[in/out]   s
@@ -11,6 +11,7 @@
 #include <algorithm>
 #include <unordered_map>
 #include <fstream>
+#include <memory>
 #include <zlib.h>  
 #include <cmath>
 
@@ -20,6 +21,7 @@
 #include "map/include/map_parameters.hpp"
 #include "map/include/commonFunc.hpp"
 #include "map/include/winSketch.hpp"
+#include "map/include/querySketch.hpp"
 #include "map/include/map_stats.hpp"
 #include "map/include/slidingMap.hpp"
 #include "map/include/MIIteratorL2.hpp"
@@ -66,6 +68,9 @@ namespace skch
       //reference sketch
       const skch::Sketch &refSketch;
 
+      //statistics for L1 and L2 stages, shared by all mappers of a run
+      Stat::MappingTable &statTable;
+
       //Container type for saving read sketches during L1 and L2 both
       typedef Sketch::MI_Type MinVec_Type;
 
@@ -75,130 +80,110 @@ namespace skch
       typedef std::function< void(const MappingResult&) > PostProcessResultsFn_t;
       PostProcessResultsFn_t processMappingResults;
 
-    public:
+      //Buffers for L1 seed lookups, reused across query fragments
+      std::vector<Sketch::MI_Range_t> seedRangesL1;
+      std::vector<MinimizerMetaData> seedHitsL1;
+
+      //L2 sliding window state, reset for each L1 candidate
+      SlideMapper<QuerySketch::Fragment_t> slidemap;
 
-      //Keep sequence length, name that appear in the contigs to compute global offsets
-      //Optionally used if visualization is enabled
-      std::vector< ContigInfo > metadata;
+      //Genomes of the reference sketch to map against, by position in the sketch, all if null
+      const std::vector<bool> *refGenomeFilter = nullptr;
+
+      //Reference sequence checked against the genome filter last, and the outcome
+      seqno_t filteredSeqId = -1;
+      bool filteredSeqSelected = true;
+
+    public:
 
       /**
        * @brief                             constructor
        * @param[in]   p                     algorithm parameters
        * @param[in]   refSketch             reference sketch
-       * @param[out]  totalQueryFragments   count of total sequence fragments in query genome
-       * @param[in]   queryno               query genome is param.querySequences[queryno]
+       * @param[in]   statTable             lookup table of mapping statistics
+       * @param[in]   querySketch           sketch of the query genome
        * @param[in]   f                     optional user defined custom function to post 
        *                                    process the reported mapping results
        */
       Map(const skch::Parameters &p, const skch::Sketch &refsketch,
-          uint64_t &totalQueryFragments,
-          int queryno,
+          Stat::MappingTable &statTable_,
+          const skch::QuerySketch &querySketch,
           PostProcessResultsFn_t f = nullptr) :
         param(p),
         refSketch(refsketch),
+        statTable(statTable_),
         processMappingResults(f)
     {
-      this->mapQuery(totalQueryFragments, param.querySequences[queryno]);
+      this->mapQuery(querySketch, 0, querySketch.fragments.size());
+    }
+
+      /**
+       * @brief                             constructor, maps a range of query fragments only
+       * @param[in]   p                     algorithm parameters
+       * @param[in]   refSketch             reference sketch
+       * @param[in]   statTable             lookup table of mapping statistics
+       * @param[in]   querySketch           sketch of the query genome
+       * @param[in]   fragmentBegin         [begin, end) range of query fragments to map
+       * @param[in]   fragmentEnd
+       * @param[in]   f                     user defined custom function to post 
+       *                                    process the reported mapping results
+       * @param[in]   genomeFilter          optional genomes of the reference sketch to map 
+       *                                    against, by position in the sketch
+       */
+      Map(const skch::Parameters &p, const skch::Sketch &refsketch,
+          Stat::MappingTable &statTable_,
+          const skch::QuerySketch &querySketch,
+          uint64_t fragmentBegin, uint64_t fragmentEnd,
+          PostProcessResultsFn_t f,
+          const std::vector<bool> *genomeFilter = nullptr) :
+        param(p),
+        refSketch(refsketch),
+        statTable(statTable_),
+        processMappingResults(f),
+        refGenomeFilter(genomeFilter)
+    {
+      this->mapQuery(querySketch, fragmentBegin, fragmentEnd);
     }
 
     private:
 
       /**
-       * @brief                                 parse over sequences in query file 
-       *                                        and map each on the reference
-       * @param[out]  totalQueryFragments       Count of total sequence fragments in query genome
-       * @param[in]   queryFileName
+       * @brief                                 map a range of fragments of the query genome 
+       *                                        on the reference
+       * @param[in]   querySketch               sketch of the query genome
+       * @param[in]   fragmentBegin             [begin, end) range of query fragments
+       * @param[in]   fragmentEnd
        */
-      void mapQuery(uint64_t &totalQueryFragments, const std::string &queryFileName)
+      void mapQuery(const skch::QuerySketch &querySketch, uint64_t fragmentBegin, uint64_t fragmentEnd)
       {
-        //Count of fragments mapped by us
-        //Some reads are dropped because of short length
-        seqno_t seqCounter = 0;
+        //Mappings are written as text to the output file only if there is no result sink
+        std::unique_ptr<std::ofstream> outstrm;
 
-        std::ofstream outstrm(param.outFileName);
+        if(processMappingResults == nullptr)
+          outstrm.reset(new std::ofstream(param.outFileName));
 
+        for(uint64_t i = fragmentBegin; i < fragmentEnd; i++)
         {
-          //Open the file using kseq
-          gzFile fp = gzopen(queryFileName.c_str(), "r");
-          kseq_t *seq = kseq_init(fp);
-
-#ifdef DEBUG
-          std::cerr << "INFO, skch::Map::mapQuery, mapping reads in " << queryFileName << std::endl;
-#endif
-
-          //size of sequence
-          offset_t len;
-
-          while ((len = kseq_read(seq)) >= 0) 
-          {
-            //How many query fragments did we consider mapping?
-            int fragmentCount = 0;
-
-            //Is the read too short?
-            if(len < param.windowSize || len < param.kmerSize || len < param.minReadLength)
-            {
-              fragmentCount = 0;
-
-              //Record contig length
-              if(param.visualize)
-                metadata.push_back( ContigInfo{seq->name.s, (offset_t)seq->seq.l} );
-
-#ifdef DEBUG
-              std::cerr << "WARNING, skch::Map::mapQuery, read is not long enough for mapping" << std::endl;
-#endif
-            }
-            else 
-            {
-              fragmentCount = len / param.minReadLength;
-
-              for (int i = 0; i < fragmentCount; i++)
-              {
-                //Record each fragment's length coverage in genome for supporting visualization
-                if(param.visualize)
-                {
-                  if (i != fragmentCount - 1)
-                    metadata.push_back( ContigInfo{seq->name.s, param.minReadLength} );
-                  else //Adjust for unmapped tail sequence
-                    metadata.push_back( ContigInfo{seq->name.s, param.minReadLength + (len % param.minReadLength)} );
-                }
-
-                QueryMetaData <decltype(seq), MinVec_Type> Q;
-                auto seqCopy = *seq;
-
-                Q.kseq = &seqCopy;
-                Q.kseq->seq.s = seq->seq.s + i * param.minReadLength;
-                Q.kseq->seq.l = param.minReadLength;
-                Q.seqCounter = seqCounter + i;
+          auto &Q = querySketch.fragments[i];
 
-                //Output vector for L2 mappings
-                MappingResultsVector_t l2Mappings;
+          //Output vector for L2 mappings
+          MappingResultsVector_t l2Mappings;
 
-                //Map this sequence
-                mapSingleQuerySeq(Q, l2Mappings, outstrm);
+          //Map this sequence
+          mapSingleQuerySeq(Q, l2Mappings);
 
-                //Write mapping results to file
-                reportL2Mappings(l2Mappings, outstrm);
-              }
-            }
-
-            seqCounter += fragmentCount;
-            totalQueryFragments += fragmentCount;
-          }
-
-          //Close the input file
-          kseq_destroy(seq);  
-          gzclose(fp);  
+          //Write mapping results to file
+          reportL2Mappings(l2Mappings, outstrm.get());
         }
       }
 
       /**
        * @brief                   map the parsed query sequence (L1 and L2 mapping)
        * @param[in]   Q           metadata about query sequence
-       * @param[in]   outstrm     outstream stream where mappings will be reported
        * @param[out]  l2Mappings  Mappings computed after L2 stage
        */
       template<typename Q_Info>
-        inline void mapSingleQuerySeq(Q_Info &Q, MappingResultsVector_t &l2Mappings, std::ofstream &outstrm)
+        inline void mapSingleQuerySeq(const Q_Info &Q, MappingResultsVector_t &l2Mappings)
         {
 #if ENABLE_TIME_PROFILE_L1_L2
           auto t0 = skch::Time::now();
@@ -225,7 +210,7 @@ namespace skch
             std::chrono::duration<double> timeSpentMappingRead = skch::Time::now() - t0;
             int countL1Candidates = l1Mappings.size();
 
-            std::cerr << Q.seq->name.s << " " << Q.kseq->seq.l
+            std::cerr << Q.seqCounter << " " << Q.len
               << " " << countL1Candidates 
               << " " << timeSpentL1.count() 
               << " " << timeSpentL2.count()
@@ -246,55 +231,25 @@ namespace skch
        * @param[out]  l1Mappings                all the read mapping locations
        */
       template <typename Q_Info, typename Vec>
-        void doL1Mapping(Q_Info &Q, Vec &l1Mappings)
+        void doL1Mapping(const Q_Info &Q, Vec &l1Mappings)
         {
-          //Vector of positions of all the hits 
-          std::vector<MinimizerMetaData> seedHitsL1;
+          //Vector of positions of all the hits, reused across query fragments
+          seedHitsL1.clear();
 
-          ///1. Compute the minimizers
-
-          CommonFunc::addMinimizers(Q.minimizerTableQuery, Q.kseq, param.kmerSize, param.windowSize, param.alphabetSize);
-
-#ifdef DEBUG
-          std::cerr << "INFO, skch::Map:doL1Mapping, read id " << Q.seqCounter << ", minimizer count = " << Q.minimizerTableQuery.size() << "\n";
-#endif
+          ///1. Minimizers of the query were computed while sketching the query (see QuerySketch)
 
           ///2. Find the hits in the reference, pick 's' unique minimizers as seeds, 
 
-          std::sort(Q.minimizerTableQuery.begin(), Q.minimizerTableQuery.end(), MinimizerInfo::lessByHash);
-
-          //note : unique preserves the original relative order of elements 
-          auto uniqEndIter = std::unique(Q.minimizerTableQuery.begin(), Q.minimizerTableQuery.end(), MinimizerInfo::equalityByHash);
-
-          //This is the sketch size for estimating jaccard
-          Q.sketchSize = std::distance(Q.minimizerTableQuery.begin(), uniqEndIter);
-
           //For invalid query (example : just NNNs), we may be left with 0 sketch size
           //Ignore the query in this case
           if(Q.sketchSize == 0)
             return;
 
-          int totalMinimizersPicked = 0;
-
-          for(auto it = Q.minimizerTableQuery.begin(); it != uniqEndIter; it++)
-          {
-            //Check if hash value exists in the reference lookup index
-            auto seedFind = refSketch.minimizerPosLookupIndex.find(it->hash);
-
-            if(seedFind != refSketch.minimizerPosLookupIndex.end())
-            {
-              auto hitPositionList = seedFind->second;
-
-              //Save the positions (Ignore high frequency hits)
-              if(hitPositionList.size() < refSketch.getFreqThreshold())
-              {
-                seedHitsL1.insert(seedHitsL1.end(), hitPositionList.begin(), hitPositionList.end());
-              }
-
-            }
-          }
+          //Look up all the minimizers together, hits are appended to seedHitsL1
+          refSketch.appendHits(Q.minimizerTableQuery.data(), Q.minimizerTableQuery.data() + Q.minimizerTableQuery.size(),
+              seedRangesL1, seedHitsL1);
 
-          int minimumHits = Stat::estimateMinimumHitsRelaxed(Q.sketchSize, param.kmerSize, param.percentageIdentity);
+          int minimumHits = statTable.minimumHits(Q.sketchSize);
 
           this->computeL1CandidateRegions(Q, seedHitsL1, minimumHits, l1Mappings);
         }
@@ -307,7 +262,7 @@ namespace skch
        * @param[out]  l1Mappings    all the read mapping locations
        */
       template <typename Q_Info, typename Vec1, typename Vec2>
-        void computeL1CandidateRegions(Q_Info &Q, Vec1 &seedHitsL1, int minimumHits, Vec2 &l1Mappings)
+        void computeL1CandidateRegions(const Q_Info &Q, Vec1 &seedHitsL1, int minimumHits, Vec2 &l1Mappings)
         {
           if(minimumHits < 1)
             minimumHits = 1;
@@ -325,11 +280,11 @@ namespace skch
               //Check if consecutive hits are close enough
               //NOTE: hits may span more than a read length for a valid match, as we keep window positions 
               //      for each minimizer
-              if(it2->seqId == it->seqId && it2->wpos - it->wpos < Q.kseq->seq.l)
+              if(it2->seqId == it->seqId && it2->wpos - it->wpos < Q.len && isSelected(it->seqId))
               {
                 //Save <1st pos --- 2nd pos>
                 L1_candidateLocus_t candidate{it->seqId, 
-                    std::max(0, it2->wpos - offset_t(Q.kseq->seq.l) + 1), it->wpos};
+                    std::max(0, it2->wpos - offset_t(Q.len) + 1), it->wpos};
 
                 //Check if this candidate overlaps with last inserted one
                 auto lst = l1Mappings.end(); lst--;
@@ -349,6 +304,29 @@ namespace skch
           }
         }
 
+      /**
+       * @brief                     check if a reference sequence belongs to a genome
+       *                            of the genome filter
+       * @param[in]   seqId         reference sequence id
+       */
+      bool isSelected(seqno_t seqId)
+      {
+        if(refGenomeFilter == nullptr)
+          return true;
+
+        //Hits are sorted by sequence, look up each sequence once
+        if(seqId != filteredSeqId)
+        {
+          auto genomeIter = std::upper_bound(refSketch.sequencesByFileInfo.begin(), 
+              refSketch.sequencesByFileInfo.end(), seqId);
+
+          filteredSeqId = seqId;
+          filteredSeqSelected = (*refGenomeFilter)[ std::distance(refSketch.sequencesByFileInfo.begin(), genomeIter) ];
+        }
+
+        return filteredSeqSelected;
+      }
+
       /**
        * @brief                                 Revise L1 candidate regions to more precise locations
        * @param[in]   Q                         query sequence information
@@ -357,7 +335,7 @@ namespace skch
        * @return      T/F                       true if atleast 1 mapping region is proposed
        */
       template <typename Q_Info, typename VecIn, typename VecOut>
-        bool doL2Mapping(Q_Info &Q, VecIn &l1Mappings, VecOut &l2Mappings)
+        bool doL2Mapping(const Q_Info &Q, VecIn &l1Mappings, VecOut &l2Mappings)
         {
           bool mappingReported = false;
 
@@ -367,14 +345,12 @@ namespace skch
             L2_mapLocus_t l2 = {};
             computeL2MappedRegions(Q, candidateLocus, l2);
 
-            //Compute mash distance using calculated jaccard
-            float mash_dist = Stat::j2md(1.0 * l2.sharedSketchSize/Q.sketchSize, param.kmerSize);
-
-            //Compute lower bound to mash distance within 90% confidence interval
-            float mash_dist_lower_bound = Stat::md_lower_bound(mash_dist, Q.sketchSize, param.kmerSize, 0.9);
+            //Identity from mash distance using calculated jaccard, and its upper bound 
+            //from lower bound to mash distance within 90% confidence interval
+            const Stat::MappingTable::Row &stats = statTable.getRow(Q.sketchSize);
 
-            float nucIdentity = 100 * (1 - mash_dist);
-            float nucIdentityUpperBound = 100 * (1 - mash_dist_lower_bound);
+            float nucIdentity = stats.nucIdentity[l2.sharedSketchSize];
+            float nucIdentityUpperBound = stats.nucIdentityUpperBound[l2.sharedSketchSize];
 
             //Report the alignment
             if(nucIdentityUpperBound >= param.percentageIdentity)
@@ -383,11 +359,11 @@ namespace skch
 
               //Save the output
               {
-                res.queryLen = Q.kseq->seq.l;
+                res.queryLen = Q.len;
                 res.refStartPos = l2.meanOptimalPos ;
-                res.refEndPos = l2.meanOptimalPos + Q.kseq->seq.l - 1;
+                res.refEndPos = l2.meanOptimalPos + Q.len - 1;
                 res.queryStartPos = 0;
-                res.queryEndPos = Q.kseq->seq.l - 1;
+                res.queryEndPos = Q.len - 1;
                 res.refSeqId = l2.seqId;
                 res.querySeqId = Q.seqCounter;
                 res.nucIdentity = nucIdentity;
@@ -412,7 +388,7 @@ namespace skch
        * @param[out]  l2_out                    L2 mapping inside L1 candidate 
        */
       template <typename Q_Info>
-        void computeL2MappedRegions(Q_Info &Q, 
+        void computeL2MappedRegions(const Q_Info &Q, 
             L1_candidateLocus_t &candidateLocus, 
             L2_mapLocus_t &l2_out)
         {
@@ -421,7 +397,7 @@ namespace skch
               candidateLocus.rangeStartPos);
 
           //Count of minimizer windows in a super-window
-          offset_t countMinimizerWindows = Q.kseq->seq.l - (param.windowSize-1) - (param.kmerSize-1); 
+          offset_t countMinimizerWindows = Q.len - (param.windowSize-1) - (param.kmerSize-1); 
 
           //Look up the end of the first L2 super-window in the index
           MIIter_t firstSuperWindowRangeEnd = this->refSketch.searchIndex(candidateLocus.seqId, 
@@ -429,11 +405,12 @@ namespace skch
 
           //Look up L1 candidate's end in the index
           MIIter_t lastSuperWindowRangeEnd = this->refSketch.searchIndex(candidateLocus.seqId, 
-              candidateLocus.rangeEndPos + Q.kseq->seq.l);
+              candidateLocus.rangeEndPos + Q.len);
 
-          //Define map such that it contains only the query minimizers
+          //Rank the query sketch and the candidate's reference minimizers, window starts empty
           //Used to efficiently compute the jaccard similarity between qry and ref
-          SlideMapper<Q_Info> slidemap(Q);
+          slidemap.reset(Q, firstSuperWindowRangeStart, 
+              std::max(firstSuperWindowRangeEnd, lastSuperWindowRangeEnd));
 
           //Initialize iterator over minimizerIndex
           MIIteratorL2 mi_L2iter( firstSuperWindowRangeStart, firstSuperWindowRangeEnd,
@@ -493,12 +470,13 @@ namespace skch
         }
 
       /**
-       * @brief                     Report the final L2 mappings to output stream
+       * @brief                     Report the final L2 mappings to the result sink, 
+       *                            or to output stream
        * @param[in]   l2Mappings    mapping results
-       * @param[in]   outstrm       file output stream object
+       * @param[in]   outstrm       file output stream object, null if results go to the sink only
        */
       void reportL2Mappings(MappingResultsVector_t &l2Mappings, 
-          std::ofstream &outstrm)
+          std::ofstream *outstrm)
       {
         float bestNucIdentity = 0;
 
@@ -515,23 +493,26 @@ namespace skch
           //Report top 1% mappings (unless reportAll flag is true, in which case we report all)
           if(param.reportAll == true || e.nucIdentity >= bestNucIdentity - 1.0)
           {
-            outstrm << e.querySeqId 
-              << " " << e.queryLen 
-              << " " << e.queryStartPos
-              << " " << e.queryEndPos
-              << " " << "+/-"
-              << " " << this->refSketch.metadata[e.refSeqId].name
-              << " " << this->refSketch.metadata[e.refSeqId].len
-              << " " << e.refStartPos 
-              << " " << e.refEndPos
-              << " " << e.nucIdentity;
-
-            //Print some additional statistics
-            outstrm << " " << e.conservedSketches 
-              << " " << e.sketchSize 
-              << " " << e.nucIdentityUpperBound;
-
-            outstrm << "\n";
+            if(outstrm != nullptr)
+            {
+              *outstrm << e.querySeqId 
+                << " " << e.queryLen 
+                << " " << e.queryStartPos
+                << " " << e.queryEndPos
+                << " " << "+/-"
+                << " " << this->refSketch.getContigName(e.refSeqId)
+                << " " << this->refSketch.getContigLength(e.refSeqId)
+                << " " << e.refStartPos 
+                << " " << e.refEndPos
+                << " " << e.nucIdentity;
+
+              //Print some additional statistics
+              *outstrm << " " << e.conservedSketches 
+                << " " << e.sketchSize 
+                << " " << e.nucIdentityUpperBound;
+
+              *outstrm << "\n";
+            }
 
             //User defined processing of the results
             if(processMappingResults != nullptr)
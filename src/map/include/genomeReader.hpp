@@ -0,0 +1,448 @@
+/**
+ * @file    genomeReader.hpp
+ * @brief   reads and decompresses genome files ahead of their use, on dedicated threads
+ */
+
+#ifndef GENOME_READER_HPP
+#define GENOME_READER_HPP
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cctype>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Own includes
+#include "map/include/base_types.hpp"
+
+//External includes
+#include "common/kseq.h"
+
+KSEQ_INIT(gzFile, gzread)
+
+namespace skch
+{
+  /**
+   * @brief     a sequence of a parsed genome, laid out like kseq_t so that routines
+   *            taking a kseq parser (e.g. CommonFunc::addMinimizers) accept it as well
+   */
+  struct SequenceRecord
+  {
+    kstring_t name;
+    kstring_t seq;
+  };
+
+  /**
+   * @brief     all sequences of a genome file
+   * @details   Plain FASTA files are memory-mapped privately and parsed in place, sequences
+   *            on a single line are used without copying, multi-line sequences are compacted
+   *            within the mapping. Other inputs (gzip, FASTQ, CRLF line ends) are parsed with
+   *            kseq into one buffer
+   */
+  struct ParsedGenome
+  {
+    std::vector<char> buffer;
+    std::vector<SequenceRecord> records;
+
+    //Private copy-on-write mapping of a plain FASTA file, if used
+    char *mapped = nullptr;
+    uint64_t mappedSize = 0;
+
+    ParsedGenome() = default;
+    ParsedGenome(const ParsedGenome &) = delete;
+    ParsedGenome & operator=(const ParsedGenome &) = delete;
+
+    ~ParsedGenome()
+    {
+      if (mapped != nullptr)
+        munmap(mapped, mappedSize);
+    }
+
+    /**
+     * @brief                   size of the sequences and names held
+     */
+    uint64_t size() const
+    {
+      return buffer.size() + mappedSize;
+    }
+
+    /**
+     * @brief                   parse a fasta/q genome file, possibly gzip compressed
+     * @param[in]   fileName
+     * @param[in]   maxSize     largest file contents accepted, after decompression
+     * @return                  false if the contents are larger than maxSize
+     */
+    bool read(const std::string &fileName, uint64_t maxSize = std::numeric_limits<uint64_t>::max())
+    {
+      //Contents are measured before parsing, so that oversized ones are never held
+      if (maxSize != std::numeric_limits<uint64_t>::max() && !contentsFit(fileName, maxSize))
+        return false;
+
+      if (readMapped(fileName))
+        return true;
+
+      gzFile fp = gzopen(fileName.c_str(), "r");
+      kseq_t *seq = kseq_init(fp);
+
+      //Offsets into buffer, as it may be reallocated while reading
+      std::vector< std::pair<uint64_t, uint64_t> > offsets;
+
+      while (kseq_read(seq) >= 0)
+      {
+        offsets.emplace_back(buffer.size(), buffer.size() + seq->name.l + 1);
+        buffer.insert(buffer.end(), seq->name.s, seq->name.s + seq->name.l + 1);
+        buffer.insert(buffer.end(), seq->seq.s, seq->seq.s + seq->seq.l + 1);
+
+        records.emplace_back();
+        records.back().name.l = seq->name.l;
+        records.back().seq.l = seq->seq.l;
+      }
+
+      kseq_destroy(seq);
+      gzclose(fp);
+
+      for (uint64_t i = 0; i < records.size(); i++)
+      {
+        records[i].name.s = buffer.data() + offsets[i].first;
+        records[i].name.m = records[i].name.l + 1;
+        records[i].seq.s = buffer.data() + offsets[i].second;
+        records[i].seq.m = records[i].seq.l + 1;
+      }
+
+      return true;
+    }
+
+    /**
+     * @brief                   parse plain FASTA contents held in memory, e.g. received from a client
+     * @param[in]   data        file contents, kept by the genome and parsed in place
+     * @return                  false if the contents are not plain FASTA (see parseInPlace)
+     */
+    bool readBuffer(std::vector<char> &&data)
+    {
+      buffer = std::move(data);
+
+      if (!buffer.empty() && buffer.back() != '\n')
+        buffer.push_back('\n');
+
+      return !buffer.empty() && parseInPlace(buffer.data(), buffer.size());
+    }
+
+    private:
+
+    /**
+     * @brief                   check the size of the contents of a file, after decompression,
+     *                          reading no more than maxSize + 1 bytes of them
+     * @param[in]   fileName
+     * @param[in]   maxSize
+     * @return                  false if the contents are larger than maxSize, or can not be read
+     */
+    static bool contentsFit(const std::string &fileName, uint64_t maxSize)
+    {
+      gzFile fp = gzopen(fileName.c_str(), "r");
+
+      if (fp == nullptr)
+        return false;
+
+      std::vector<char> chunk (1 << 16);
+      uint64_t total = 0;
+      int n = 0;
+
+      while (total <= maxSize && (n = gzread(fp, chunk.data(), chunk.size())) > 0)
+        total += n;
+
+      gzclose(fp);
+      return n >= 0 && total <= maxSize;
+    }
+
+    /**
+     * @brief                   parse a plain FASTA file in place, memory-mapped privately
+     * @param[in]   fileName
+     * @return                  true if the file was parsed
+     */
+    bool readMapped(const std::string &fileName)
+    {
+      int fd = ::open(fileName.c_str(), O_RDONLY);
+      struct stat st;
+
+      if (fd < 0)
+        return false;
+
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+      {
+        close(fd);
+        return false;
+      }
+
+      uint64_t size = st.st_size;
+      void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      close(fd);
+
+      if (addr == MAP_FAILED)
+        return false;
+
+      madvise(addr, size, MADV_SEQUENTIAL);
+
+      if (!parseInPlace(static_cast<char *>(addr), size))
+      {
+        munmap(addr, size);
+        return false;
+      }
+
+      mapped = static_cast<char *>(addr);
+      mappedSize = size;
+      return true;
+    }
+
+    /**
+     * @brief                   parse plain FASTA contents in place, yields the same records as kseq
+     * @details                 record and line boundaries are found with memchr, which is
+     *                          vectorized in libc. Name ends at the first white space of the header
+     *                          line, and is null terminated in place. Contents kseq would treat
+     *                          differently (not starting with '>', without final new line, with
+     *                          '\r', or with lines starting with '+' or '@') are left to kseq
+     * @param[in]   p           contents, modified in place
+     * @param[in]   size        size of contents, at least 1
+     * @return                  true if the contents were parsed
+     */
+    bool parseInPlace(char *p, uint64_t size)
+    {
+      char *end = p + size;
+
+      if (p[0] != '>' || end[-1] != '\n' || memchr(p, '\r', size) != nullptr)
+        return false;
+
+      char *cursor = p;
+
+      while (cursor < end)
+      {
+        //Header line, cursor is at '>'
+        char *lineEnd = static_cast<char *>(memchr(cursor, '\n', end - cursor));
+
+        char *nameEnd = cursor + 1;
+        while (nameEnd < lineEnd && !isspace((unsigned char) *nameEnd))
+          nameEnd++;
+
+        SequenceRecord record;
+        record.name.s = cursor + 1;
+        record.name.l = nameEnd - record.name.s;
+        record.name.m = record.name.l + 1;
+        *nameEnd = '\0';
+
+        //Sequence lines, moved next to each other only if there are several
+        char *seqBegin = lineEnd + 1;
+        char *out = seqBegin;
+        cursor = seqBegin;
+
+        while (cursor < end && *cursor != '>')
+        {
+          if (*cursor == '+' || *cursor == '@')
+          {
+            records.clear();
+            return false;
+          }
+
+          lineEnd = static_cast<char *>(memchr(cursor, '\n', end - cursor));
+
+          if (out != cursor)
+            memmove(out, cursor, lineEnd - cursor);
+
+          out += lineEnd - cursor;
+          cursor = lineEnd + 1;
+        }
+
+        //Null terminated like kseq, there is room if a new line was consumed, 
+        //an empty sequence uses the terminator of the name instead
+        if (out < cursor)
+        {
+          *out = '\0';
+          record.seq.s = seqBegin;
+        }
+        else
+          record.seq.s = nameEnd;
+
+        record.seq.l = out - seqBegin;
+        record.seq.m = record.seq.l + 1;
+
+        records.push_back(record);
+      }
+
+      return true;
+    }
+  };
+
+  /**
+   * @class     skch::GenomeReader
+   * @brief     reads a list of genome files on dedicated threads, in list order,
+   *            ahead of the sketching threads that consume them
+   * @details   Parsed genomes wait in a buffer until taken. Readers stop reading ahead
+   *            while the buffer holds more than maxBufferedBytes of sequences, so memory
+   *            stays bounded. A consumer that asks for a genome no reader has started yet
+   *            reads it itself, consumers thus never wait on readers blocked by a full buffer.
+   *            Each genome must be taken exactly once
+   */
+  class GenomeReader
+  {
+    private:
+
+      enum State : uint8_t { PENDING, READING, READY, TAKEN };
+
+      std::vector<std::string> fileNames;
+      uint64_t maxBufferedBytes;
+
+      std::mutex mutex;
+      std::condition_variable genomeReady;
+      std::condition_variable bufferFreed;
+
+      std::vector<State> state;
+      std::vector< std::unique_ptr<ParsedGenome> > genomes;
+
+      //Readers pick genomes in list order, all genomes before this one are not pending
+      uint64_t nextPending = 0;
+      uint64_t bufferedBytes = 0;
+      bool stopping = false;
+
+      std::vector<std::thread> readers;
+
+    public:
+
+      //Default bound on size of genomes read but not taken yet
+      static const uint64_t defaultBufferSize = 1ULL << 28;
+
+      /**
+       * @brief                     count of reader threads to use along with sketching threads
+       * @param[in] threads         count of sketching threads
+       */
+      static int threadCount(int threads)
+      {
+        return 1 + threads / 16;
+      }
+
+      /**
+       * @brief                     start the reader threads
+       * @param[in] fileNames_      genome files
+       * @param[in] readerCount     count of reader threads
+       * @param[in] maxBufferedBytes_   bound on size of genomes read but not taken yet
+       */
+      GenomeReader(const std::vector<std::string> &fileNames_, int readerCount, uint64_t maxBufferedBytes_) :
+        fileNames(fileNames_),
+        maxBufferedBytes(maxBufferedBytes_),
+        state(fileNames_.size(), PENDING),
+        genomes(fileNames_.size())
+      {
+        for (int i = 0; i < readerCount; i++)
+          readers.emplace_back(&GenomeReader::readAhead, this);
+      }
+
+      GenomeReader(const GenomeReader &) = delete;
+      GenomeReader & operator=(const GenomeReader &) = delete;
+
+      /**
+       * @brief     stop the reader threads, genomes being read are finished first
+       */
+      ~GenomeReader()
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          stopping = true;
+        }
+
+        bufferFreed.notify_all();
+
+        for (auto &t : readers)
+          t.join();
+      }
+
+      /**
+       * @brief                     take a genome, waits if it is being read
+       * @param[in] i               index of the genome in the file list
+       * @return                    parsed genome, owned by the caller
+       */
+      std::unique_ptr<ParsedGenome> take(uint64_t i)
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (state[i] == PENDING)
+        {
+          state[i] = TAKEN;
+          lock.unlock();
+
+          std::unique_ptr<ParsedGenome> genome (new ParsedGenome());
+          genome->read(fileNames[i]);
+          return genome;
+        }
+
+        genomeReady.wait(lock, [&] { return state[i] == READY; });
+
+        state[i] = TAKEN;
+        bufferedBytes -= genomes[i]->size();
+        bufferFreed.notify_all();
+
+        return std::move(genomes[i]);
+      }
+
+      /**
+       * @brief                     mark a genome as not needed, it is not read if
+       *                            no reader has started on it yet
+       * @param[in] i               index of the genome in the file list
+       */
+      void skip(uint64_t i)
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+
+          if (state[i] == PENDING)
+          {
+            state[i] = TAKEN;
+            return;
+          }
+        }
+
+        take(i);
+      }
+
+    private:
+
+      /**
+       * @brief     reader thread, reads pending genomes in list order while the buffer has room
+       */
+      void readAhead()
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+          bufferFreed.wait(lock, [&] { return stopping || bufferedBytes < maxBufferedBytes; });
+
+          while (nextPending < state.size() && state[nextPending] != PENDING)
+            nextPending++;
+
+          if (stopping || nextPending == state.size())
+            return;
+
+          uint64_t i = nextPending++;
+          state[i] = READING;
+          lock.unlock();
+
+          std::unique_ptr<ParsedGenome> genome (new ParsedGenome());
+          genome->read(fileNames[i]);
+
+          lock.lock();
+          bufferedBytes += genome->size();
+          genomes[i] = std::move(genome);
+          state[i] = READY;
+          genomeReady.notify_all();
+        }
+      }
+  };
+}
+
+#endif
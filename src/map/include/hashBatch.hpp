@@ -0,0 +1,256 @@
+/**
+ * @file    hashBatch.hpp
+ * @brief   batched murmur3 hashing of consecutive kmers, vectorized with
+ *          AVX-512 when the cpu supports it
+ */
+
+#ifndef HASH_BATCH_HPP
+#define HASH_BATCH_HPP
+
+#include <cstdint>
+
+//Own includes
+#include "map/include/base_types.hpp"
+
+//External includes
+#include "common/murmur3.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HASH_BATCH_X86 1
+#include <immintrin.h>
+#else
+#define HASH_BATCH_X86 0
+#endif
+
+namespace skch
+{
+  /**
+   * @namespace skch::HashBatch
+   * @brief     Hashes kmers starting at consecutive positions of a sequence,
+   *            several kmers per instruction. Hash values are identical to
+   *            the lower 32 bits of MurmurHash3_x64_128, as computed by
+   *            CommonFunc::getHash(). The vector kernel is compiled with target
+   *            attributes, and picked at run time. AVX2 has no 64-bit multiply, and
+   *            emulating it made an AVX2 kernel slower than scalar code, so AVX2 cpus
+   *            use scalar code
+   */
+  namespace HashBatch
+  {
+    //Instruction sets, in increasing order of preference
+    enum ISA { scalar = 0, avx512 = 1 };
+
+    /**
+     * @brief   best instruction set supported by the cpu
+     */
+    inline int detectISA()
+    {
+#if HASH_BATCH_X86
+      __builtin_cpu_init();
+
+      if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq"))
+        return avx512;
+#endif
+      return scalar;
+    }
+
+    /**
+     * @brief   instruction set used by getHashes(), detected once
+     */
+    inline int getISA()
+    {
+      static const int isa = detectISA();
+      return isa;
+    }
+
+    /**
+     * @brief                 hash kmers one at a time
+     * @param[in]   seq       kmer i starts at seq[i]
+     * @param[in]   kmerSize
+     * @param[in]   seed
+     * @param[in]   count     count of kmers
+     * @param[out]  hashes
+     */
+    inline void getHashesScalar(const char *seq, int kmerSize, uint32_t seed, int count, hash_t *hashes)
+    {
+      for (int i = 0; i < count; i++)
+      {
+        uint64_t data[2];
+        MurmurHash3_x64_128(seq + i, kmerSize, seed, data);
+        hashes[i] = (hash_t) data[0];
+      }
+    }
+
+#if HASH_BATCH_X86
+
+    /*
+     * Vector kernel follows MurmurHash3_x64_128 for keys shorter than 32 bytes,
+     * i.e. at most one 16 byte block followed by the tail, with one kmer per 64-bit lane.
+     * The 16 bytes at seq + i + offset are loaded once, and shuffled so that lane j
+     * holds the little-endian word starting at byte j, same as the scalar block/tail read
+     */
+
+#define HASH_BATCH_AVX512 "avx512f,avx512bw,avx512dq"
+
+    /*
+     * Shift, rotate, broadcast and narrowing intrinsics without a mask leave their 
+     * pass-through operand undefined, which GCC reports as maybe uninitialized.
+     * Zero-masking forms with all lanes selected compute the same from defined values
+     */
+
+    template <int r>
+    __attribute__((target(HASH_BATCH_AVX512)))
+    inline __m512i srli64AVX512(__m512i x)
+    {
+      return _mm512_maskz_srli_epi64(0xff, x, r);
+    }
+
+    template <int r>
+    __attribute__((target(HASH_BATCH_AVX512)))
+    inline __m512i rotl64AVX512(__m512i x)
+    {
+      return _mm512_maskz_rol_epi64(0xff, x, r);
+    }
+
+    __attribute__((target(HASH_BATCH_AVX512)))
+    inline __m512i fmix64AVX512(__m512i k)
+    {
+      k = _mm512_xor_si512(k, srli64AVX512<33>(k));
+      k = _mm512_mullo_epi64(k, _mm512_set1_epi64(0xff51afd7ed558ccdULL));
+      k = _mm512_xor_si512(k, srli64AVX512<33>(k));
+      k = _mm512_mullo_epi64(k, _mm512_set1_epi64(0xc4ceb9fe1a85ec53ULL));
+      k = _mm512_xor_si512(k, srli64AVX512<33>(k));
+      return k;
+    }
+
+    /**
+     * @brief     words starting at bytes 0 .. 7 of p, one per lane
+     */
+    __attribute__((target(HASH_BATCH_AVX512)))
+    inline __m512i loadWordsAVX512(const char *p)
+    {
+      const __m512i shuffle = _mm512_set_epi64(
+          0x0e0d0c0b0a090807ULL, 0x0d0c0b0a09080706ULL,
+          0x0c0b0a0908070605ULL, 0x0b0a090807060504ULL,
+          0x0a09080706050403ULL, 0x0908070605040302ULL,
+          0x0807060504030201ULL, 0x0706050403020100ULL);
+
+      __m512i v = _mm512_maskz_broadcast_i32x4(0xffff, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+      return _mm512_shuffle_epi8(v, shuffle);
+    }
+
+    /**
+     * @brief                 hash kmers, 8 at a time
+     * @param[in]   seq       kmer i starts at seq[i]
+     * @param[in]   seqLen    count of readable bytes starting at seq
+     * @param[in]   kmerSize  < 32
+     * @param[in]   seed
+     * @param[in]   count     count of kmers
+     * @param[out]  hashes
+     * @return                count of kmers hashed, remaining ones are left to scalar code
+     */
+    __attribute__((target(HASH_BATCH_AVX512)))
+    inline int getHashesAVX512(const char *seq, int seqLen, int kmerSize, uint32_t seed, int count, hash_t *hashes)
+    {
+      const int nblocks = kmerSize / 16;
+      const int tail = kmerSize & 15;
+      const int tailOffset = 16 * nblocks;
+
+      //Vector loads read 16 bytes starting at the last word offset
+      const int lastOffset = tail > 8 ? tailOffset + 8 : (tail > 0 ? tailOffset : 8);
+
+      const __m512i c1 = _mm512_set1_epi64(0x87c37b91114253d5ULL);
+      const __m512i c2 = _mm512_set1_epi64(0x4cf5ad432745937fULL);
+      const __m512i five = _mm512_set1_epi64(5);
+      const __m512i seedVec = _mm512_set1_epi64(seed);
+      const __m512i lenVec = _mm512_set1_epi64(kmerSize);
+      const __m512i mask1 = _mm512_set1_epi64(tail >= 8 ? ~0ULL : (1ULL << (8 * tail)) - 1);
+      const __m512i mask2 = _mm512_set1_epi64(tail > 8 ? (1ULL << (8 * (tail - 8))) - 1 : 0);
+
+      int i = 0;
+
+      for (; i + 8 <= count && i + lastOffset + 16 <= seqLen; i += 8)
+      {
+        const char *p = seq + i;
+
+        __m512i h1 = seedVec;
+        __m512i h2 = seedVec;
+
+        if (nblocks)
+        {
+          __m512i k1 = loadWordsAVX512(p);
+          __m512i k2 = loadWordsAVX512(p + 8);
+
+          k1 = _mm512_mullo_epi64(k1, c1); k1 = rotl64AVX512<31>(k1); k1 = _mm512_mullo_epi64(k1, c2); h1 = _mm512_xor_si512(h1, k1);
+
+          h1 = rotl64AVX512<27>(h1); h1 = _mm512_add_epi64(h1, h2);
+          h1 = _mm512_add_epi64(_mm512_mullo_epi64(h1, five), _mm512_set1_epi64(0x52dce729));
+
+          k2 = _mm512_mullo_epi64(k2, c2); k2 = rotl64AVX512<33>(k2); k2 = _mm512_mullo_epi64(k2, c1); h2 = _mm512_xor_si512(h2, k2);
+
+          h2 = rotl64AVX512<31>(h2); h2 = _mm512_add_epi64(h2, h1);
+          h2 = _mm512_add_epi64(_mm512_mullo_epi64(h2, five), _mm512_set1_epi64(0x38495ab5));
+        }
+
+        if (tail > 8)
+        {
+          __m512i k2 = _mm512_and_si512(loadWordsAVX512(p + tailOffset + 8), mask2);
+          k2 = _mm512_mullo_epi64(k2, c2); k2 = rotl64AVX512<33>(k2); k2 = _mm512_mullo_epi64(k2, c1); h2 = _mm512_xor_si512(h2, k2);
+        }
+
+        if (tail > 0)
+        {
+          __m512i k1 = _mm512_and_si512(loadWordsAVX512(p + tailOffset), mask1);
+          k1 = _mm512_mullo_epi64(k1, c1); k1 = rotl64AVX512<31>(k1); k1 = _mm512_mullo_epi64(k1, c2); h1 = _mm512_xor_si512(h1, k1);
+        }
+
+        //finalization
+        h1 = _mm512_xor_si512(h1, lenVec);
+        h2 = _mm512_xor_si512(h2, lenVec);
+
+        h1 = _mm512_add_epi64(h1, h2);
+        h2 = _mm512_add_epi64(h2, h1);
+
+        h1 = fmix64AVX512(h1);
+        h2 = fmix64AVX512(h2);
+
+        h1 = _mm512_add_epi64(h1, h2);
+
+        //Keep the lower 32 bits of each lane
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(hashes + i), _mm512_maskz_cvtepi64_epi32(0xff, h1));
+      }
+
+      return i;
+    }
+
+#undef HASH_BATCH_AVX512
+
+#endif
+
+    /**
+     * @brief                 hash kmers starting at consecutive positions,
+     *                        same values as CommonFunc::getHash()
+     * @param[in]   seq       kmer i starts at seq[i]
+     * @param[in]   seqLen    count of readable bytes starting at seq, at least count + kmerSize - 1
+     * @param[in]   kmerSize
+     * @param[in]   seed
+     * @param[in]   count     count of kmers
+     * @param[out]  hashes
+     */
+    inline void getHashes(const char *seq, int seqLen, int kmerSize, uint32_t seed, int count, hash_t *hashes)
+    {
+      int done = 0;
+
+#if HASH_BATCH_X86
+      if (kmerSize < 32)
+      {
+        if (getISA() == avx512)
+          done = getHashesAVX512(seq, seqLen, kmerSize, seed, count, hashes);
+      }
+#endif
+
+      getHashesScalar(seq + done, kmerSize, seed, count - done, hashes + done);
+    }
+  }
+}
+
+#endif
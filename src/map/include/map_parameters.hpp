@@ -10,7 +10,9 @@
 
 //Switch to enable timing of L1 and L2 stages for each read
 //Timings are reported in a file
+#ifndef ENABLE_TIME_PROFILE_L1_L2
 #define ENABLE_TIME_PROFILE_L1_L2 0
+#endif
 
 namespace skch
 {
@@ -32,9 +34,17 @@ namespace skch
     std::vector<std::string> refSequences;            //reference sequence(s)
     std::vector<std::string> querySequences;          //query sequence(s)
     std::string outFileName;                          //output file name
+    std::string refIndex;                             //reference index file, used instead of parsing refSequences
     bool reportAll;                                   //Report all alignments if this is true
     bool visualize;                                   //Visualize the conserved regions of two genomes
     bool matrixOutput;                                //report fastani results as lower triangular matrix
+    bool binaryOutput;                                //report fastani results in binary format, see cgi::BinaryResults
+    bool rollingHash;                                 //hash kmers with rolling 2-bit canonical hash instead of murmur3
+    std::string checkpointDir;                        //directory where completed work is saved, empty if disabled
+    bool resume;                                      //skip work completed in checkpointDir by an earlier run
+    int shardId;                                      //shard of genome pairs computed by this run, 1-based
+    int shardCount;                                   //count of shards the genome pairs are split into, 0 if not sharded
+    bool prefilter;                                   //skip genome pairs which can not be reported, judged from whole-genome sketches
   };
 }
 
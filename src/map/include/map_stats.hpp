@@ -10,6 +10,9 @@
 #include <algorithm>
 #include <deque>
 #include <cmath>
+#include <atomic>
+#include <cassert>
+#include <memory>
 
 #ifdef USE_BOOST
     #include <boost/math/distributions/binomial.hpp>
@@ -167,17 +170,17 @@ namespace skch
     }
 
     /**
-     * @brief                     calculate p-value for a given alignment identity, sketch size..
+     * @brief                     calculate p-value for a given sketch size and minimum count 
+     *                            of shared sketches, see estimateMinimumHitsRelaxed()
      * @param[in] s               sketch size
+     * @param[in] x               minimum count of shared sketches for a mapping
      * @param[in] k               kmer size
      * @param[in] alphabetSize    alphabet size
-     * @param[in] identity        mapping identity cut-off
      * @param[in] lengthQuery     query length
      * @param[in] lengthReference reference length
      * @return                    p-value
      */
-    inline double estimate_pvalue (int s, int k, int alphabetSize, 
-        float identity, 
+    inline double estimate_pvalue (int s, int x, int k, int alphabetSize, 
         int lengthQuery, uint64_t lengthReference)
     {
       //total space size of k-mers
@@ -190,8 +193,6 @@ namespace skch
       //Jaccard similarity of two random given sequences
       double r = pX * pY / (pX + pY - pX * pY);
 
-      int x = estimateMinimumHitsRelaxed(s, k, identity);
-
       //P (x or more minimizers match)
       double cdf_complement;
       if(x == 0)
@@ -212,6 +213,136 @@ namespace skch
       return pVal;
     }
 
+    /**
+     * @class     skch::Stat::MappingTable
+     * @brief     per-run lookup table of the statistics needed for mapping a fragment, 
+     *            indexed by sketch size 's' and count of shared sketches
+     * @details   Entries are computed on first use of a sketch size, and published atomically,
+     *            so that the table is shared by all threads without locks.
+     *            For each sketch size, table holds minimum count of hits for L1 
+     *            (estimateMinimumHitsRelaxed()), and a row of identity with its upper bound 
+     *            (md_lower_bound() at 90% confidence interval) for every count of shared 
+     *            sketches in L2
+     */
+    class MappingTable
+    {
+      public:
+
+        struct Row
+        {
+          std::vector<float> nucIdentity;               //indexed by count of shared sketches [0, s]
+          std::vector<float> nucIdentityUpperBound;
+        };
+
+      private:
+
+        int k;
+        float perc_identity;
+        int maxSketchSize;
+
+        //Minimum count of hits of each sketch size, -1 if not computed yet
+        std::unique_ptr< std::atomic<int>[] > minHits;
+
+        std::unique_ptr< std::atomic<Row*>[] > rows;
+
+      public:
+
+        /**
+         * @brief                 constructor
+         * @param[in] k           kmer size
+         * @param[in] identity    percentage identity [0-100]
+         * @param[in] maxSketchSize   largest sketch size looked up, e.g. the fragment length
+         */
+        MappingTable(int k_, float perc_identity_, int maxSketchSize_) :
+          k(k_),
+          perc_identity(perc_identity_),
+          maxSketchSize(std::max(maxSketchSize_, 0)),
+          minHits(new std::atomic<int>[maxSketchSize + 1]),
+          rows(new std::atomic<Row*>[maxSketchSize + 1])
+        {
+          for(int s = 0; s <= maxSketchSize; s++)
+          {
+            minHits[s].store(-1, std::memory_order_relaxed);
+            rows[s].store(nullptr, std::memory_order_relaxed);
+          }
+        }
+
+        MappingTable(const MappingTable &) = delete;
+        MappingTable & operator=(const MappingTable &) = delete;
+
+        ~MappingTable()
+        {
+          for(int s = 0; s <= maxSketchSize; s++)
+            delete rows[s].load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief                 identity and its upper bound for a sketch size
+         * @param[in] s           sketch size, 1 <= s <= maxSketchSize
+         * @return                table row
+         */
+        const Row & getRow(int s)
+        {
+          assert(s >= 1 && s <= maxSketchSize);
+
+          Row *row = rows[s].load(std::memory_order_acquire);
+
+          if(row == nullptr)
+          {
+            Row *newRow = computeRow(s);
+
+            //Another thread may have published the row in the meantime
+            if(rows[s].compare_exchange_strong(row, newRow, std::memory_order_acq_rel, std::memory_order_acquire))
+              row = newRow;
+            else
+              delete newRow;
+          }
+
+          return *row;
+        }
+
+        /**
+         * @brief                 minimum count of shared sketches for an L1 candidate
+         * @param[in] s           sketch size
+         */
+        int minimumHits(int s)
+        {
+          assert(s >= 1 && s <= maxSketchSize);
+
+          int x = minHits[s].load(std::memory_order_relaxed);
+
+          //Racing threads compute the same value
+          if(x < 0)
+          {
+            x = estimateMinimumHitsRelaxed(s, k, perc_identity);
+            minHits[s].store(x, std::memory_order_relaxed);
+          }
+
+          return x;
+        }
+
+      private:
+
+        Row* computeRow(int s) const
+        {
+          Row *row = new Row();
+
+          row->nucIdentity.resize(s + 1);
+          row->nucIdentityUpperBound.resize(s + 1);
+
+          for(int x = 0; x <= s; x++)
+          {
+            float mash_dist = j2md(1.0 * x/s, k);
+            float mash_dist_lower_bound = md_lower_bound(mash_dist, s, k, 0.9);
+
+            row->nucIdentity[x] = 100 * (1 - mash_dist);
+            row->nucIdentityUpperBound[x] = 100 * (1 - mash_dist_lower_bound);
+          }
+
+          return row;
+        }
+    };
+
     /**
      * @brief                     calculate minimum window size for sketching that satisfies
      *                            the given p-value threshold
@@ -236,10 +367,13 @@ namespace skch
 
       int optimalSketchSize;
 
+      //Minimum hits of each sketch size come from the same table used while mapping
+      MappingTable table(k, identity, lengthQuery);
+
       for(auto &e : potentialSketchValues)
       {
         //Compute pvalue
-        double pVal = estimate_pvalue(e, k, alphabetSize, identity, lengthQuery, lengthReference);
+        double pVal = estimate_pvalue(e, table.minimumHits(e), k, alphabetSize, lengthQuery, lengthReference);
 
         //Check if pvalue is <= cutoff
         if(pVal <= pValue_cutoff)
@@ -11,11 +11,13 @@
 #include <string>
 #include <fstream>
 #include <cassert>
+#include <cstdio>
 
 //Own includes
 #include "map/include/map_parameters.hpp"
 #include "map/include/map_stats.hpp"
 #include "map/include/commonFunc.hpp"
+#include "map/include/refIndex.hpp"
 
 //External includes
 #include "common/clipp.h"
@@ -52,21 +54,14 @@ namespace skch
     }
 
   /**
-   * @brief                     validate the reference and query file(s)
-   * @param[in] querySequences  vector containing query file names
-   * @param[in] refSequences    vector containing reference file names
+   * @brief                     check that all files in the list can be opened
+   * @param[in] fileList        vector containing file names
    */
   template <typename VEC>
-    void validateInputFiles(VEC &querySequences, VEC &refSequences)
+    void validateFileList(VEC &fileList)
     {
-      if (querySequences.size() == 0 || refSequences.size() == 0)
-      {
-        std::cerr << "ERROR, skch::validateInputFiles, Count of query and ref genomes should be non-zero" << std::endl;
-        exit(1);
-      }
-
       //Open file one by one
-      for(auto &e : querySequences)
+      for(auto &e : fileList)
       {
         std::ifstream in(e);
 
@@ -76,17 +71,28 @@ namespace skch
           exit(1);
         }
       }
+    }
 
-      for(auto &e : refSequences)
+  /**
+   * @brief                     validate the reference and query file(s)
+   * @param[in] querySequences  vector containing query file names
+   * @param[in] refSequences    vector containing reference file names
+   * @param[in] refIndexed      true if reference genomes are loaded from an index,
+   *                            in which case reference files are not opened
+   */
+  template <typename VEC>
+    void validateInputFiles(VEC &querySequences, VEC &refSequences, bool refIndexed = false)
+    {
+      if (querySequences.size() == 0 || refSequences.size() == 0)
       {
-        std::ifstream in(e);
-
-        if (in.fail())
-        {
-          std::cerr << "ERROR, skch::validateInputFiles, Could not open " << e << std::endl;
-          exit(1);
-        }
+        std::cerr << "ERROR, skch::validateInputFiles, Count of query and ref genomes should be non-zero" << std::endl;
+        exit(1);
       }
+
+      validateFileList(querySequences);
+
+      if (!refIndexed)
+        validateFileList(refSequences);
     }
 
   /**
@@ -96,10 +102,15 @@ namespace skch
   void printCmdOptions(skch::Parameters &parameters)
   {
     std::cerr << ">>>>>>>>>>>>>>>>>>" << std::endl;
+    if (parameters.refIndex != "")
+      std::cerr << "Reference index = " << parameters.refIndex << std::endl;
     std::cerr << "Reference = " << parameters.refSequences << std::endl;
     std::cerr << "Query = " << parameters.querySequences << std::endl;
     std::cerr << "Kmer size = " << parameters.kmerSize << std::endl;
+    std::cerr << "Kmer hash = " << (parameters.rollingHash ? "rolling 2-bit" : "murmur3") << std::endl;
     std::cerr << "Fragment length = " << parameters.minReadLength << std::endl;
+    if (parameters.prefilter)
+      std::cerr << "Prefilter = enabled" << std::endl;
     std::cerr << "Threads = " << parameters.threads << std::endl;
     std::cerr << "ANI output file = " << parameters.outFileName << std::endl;
     std::cerr << ">>>>>>>>>>>>>>>>>>" << std::endl;
@@ -123,27 +134,41 @@ namespace skch
     parameters.percentageIdentity = 80;
     parameters.visualize = false;
     parameters.matrixOutput = false;
+    parameters.binaryOutput = false;
     parameters.referenceSize = 5000000;
     parameters.reportAll = true; //we need all mappings per fragment, not just best 1% as in mashmap
+    parameters.rollingHash = false;
+    parameters.resume = false;
+    parameters.shardId = 0;
+    parameters.shardCount = 0;
+    parameters.prefilter = false;
 
 
     std::string refName, refList;
     std::string qryName, qryList;
+    std::string shard;
     bool versioncheck = false;
     bool help = false;
 
     auto help_cmd = clipp::option("-h", "--help").set(help).doc("print this help page");
     auto ref_cmd = (clipp::option("-r", "--ref") & clipp::value("value", refName)) % "reference genome (fasta/fastq)[.gz]";
     auto refList_cmd = (clipp::option("--rl", "--refList") & clipp::value("value", refList)) % "a file containing list of reference genome files, one genome per line";
+    auto refIndex_cmd = (clipp::option("--refIndex") & clipp::value("value", parameters.refIndex)) % "reference index built using 'fastANI index', used instead of -r/--rl. Kmer size, kmer hash and fragment length are taken from the index";
     auto qry_cmd = (clipp::option("-q", "--query") & clipp::value("value", qryName)) % "query genome (fasta/fastq)[.gz]";
     auto qryList_cmd = (clipp::option("--ql", "--queryList") & clipp::value("value", qryList)) % "a file containing list of query genome files, one genome per line";
     auto kmer_cmd = (clipp::option("-k", "--kmer") & clipp::value("value", parameters.kmerSize)) % "kmer size <= 16 [default : 16]";
+    auto rollingHash_cmd = clipp::option("--rollingHash").set(parameters.rollingHash).doc("hash kmers with a rolling 2-bit canonical hash instead of murmur3, faster to sketch. Kmers containing non-ACGT characters are skipped. Sketches and ANI values differ slightly from the default [disabled by default]");
     auto thread_cmd = (clipp::option("-t", "--threads") & clipp::value("value", parameters.threads)) % "thread count for parallel execution [default : 1]";
     auto fraglen_cmd = (clipp::option("--fragLen") & clipp::value("value", parameters.minReadLength)) % "fragment length [default : 3,000]";
     auto minfraction_cmd = (clipp::option("--minFraction") & clipp::value("value", parameters.minFraction)) % "minimum fraction of genome that must be shared for trusting ANI. If reference and query genome size differ, smaller one among the two is considered. [default : 0.2]";
     auto visualize_cmd = clipp::option("--visualize").set(parameters.visualize).doc("output mappings for visualization, can be enabled for single genome to single genome comparison only [disabled by default]");
     auto matrix_cmd = clipp::option("--matrix").set(parameters.matrixOutput).doc("also output ANI values as lower triangular matrix (format inspired from phylip). If enabled, you should expect an output file with .matrix extension [disabled by default]");
     auto output_cmd = (clipp::option("-o", "--output") & clipp::value("value", parameters.outFileName)) % "output file name";
+    auto binary_cmd = clipp::option("--binaryOutput").set(parameters.binaryOutput).doc("write output in a compact binary format, with query and reference genome lists followed by fixed-width records. Convert it to text using 'fastANI convert' [disabled by default]");
+    auto checkpoint_cmd = (clipp::option("--checkpoint") & clipp::value("value", parameters.checkpointDir)) % "directory where results are saved as work completes, so that an interrupted run can be resumed";
+    auto resume_cmd = clipp::option("--resume").set(parameters.resume).doc("resume the run saved in --checkpoint directory, skipping completed work. Genome lists and parameters must be the same, thread count may differ [disabled by default]");
+    auto shard_cmd = (clipp::option("--shard") & clipp::value("i/N", shard)) % "compute shard i (1-based) of N, to split a run across nodes. Query x reference genome pairs are split deterministically by genome file size, each shard writes its results keyed by genome ids (line numbers in the lists)";
+    auto prefilter_cmd = clipp::option("--prefilter").set(parameters.prefilter).doc("skip genome pairs that can not reach --minFraction at the identity threshold, judged from a sample of the minimizers of the whole query genome, before their fragments are mapped. Faster on large, diverse genome lists, pairs which would be reported are kept with high probability [disabled by default]");
     auto version_cmd = clipp::option("-v", "--version").set(versioncheck).doc("show version");
 
     auto cli =
@@ -151,15 +176,22 @@ namespace skch
        help_cmd,
        ref_cmd,
        refList_cmd,
+       refIndex_cmd,
        qry_cmd,
        qryList_cmd,
        kmer_cmd,
+       rollingHash_cmd,
        thread_cmd,
        fraglen_cmd,
        minfraction_cmd,
        visualize_cmd,
        matrix_cmd,
        output_cmd,
+       binary_cmd,
+       checkpoint_cmd,
+       resume_cmd,
+       shard_cmd,
+       prefilter_cmd,
        version_cmd
       );
 
@@ -169,7 +201,7 @@ namespace skch
       .doc_column(5)
       .last_column(80);
 
-    std::string description = "fastANI is a fast alignment-free implementation for computing whole-genome Average Nucleotide Identity (ANI) between genomes\n-----------------\nExample usage:\n$ fastANI -q genome1.fa -r genome2.fa -o output.txt\n$ fastANI -q genome1.fa --rl genome_list.txt -o output.txt";
+    std::string description = "fastANI is a fast alignment-free implementation for computing whole-genome Average Nucleotide Identity (ANI) between genomes\n-----------------\nExample usage:\n$ fastANI -q genome1.fa -r genome2.fa -o output.txt\n$ fastANI -q genome1.fa --rl genome_list.txt -o output.txt\n$ fastANI index --rl genome_list.txt -o genomes.idx\n$ fastANI -q genome1.fa --refIndex genomes.idx -o output.txt\n$ fastANI serve --refIndex genomes.idx --socket fastani.sock";
 
     if(!clipp::parse(argc, argv, cli))
     {
@@ -190,21 +222,56 @@ namespace skch
       exit(0);
     }
 
-    if (refName == "" && refList == "")
+    if (refName == "" && refList == "" && parameters.refIndex == "")
     {
       std::cerr << "Provide reference file (s)\n";
       exit(1);
     }
 
+    if (parameters.refIndex != "" && (refName != "" || refList != ""))
+    {
+      std::cerr << "Provide either reference file (s) or reference index, not both\n";
+      exit(1);
+    }
+
     if (qryName == "" && qryList == "")
     {
       std::cerr << "Provide query file (s)\n";
       exit(1);
     }
 
+    if (parameters.resume && parameters.checkpointDir == "")
+    {
+      std::cerr << "Provide the checkpoint directory to resume with --checkpoint\n";
+      exit(1);
+    }
+
+    if (parameters.visualize && parameters.checkpointDir != "")
+    {
+      std::cerr << "--visualize can not be used with --checkpoint\n";
+      exit(1);
+    }
+
+    if (shard != "")
+    {
+      char rest;
+      if (sscanf(shard.c_str(), "%d/%d%c", &parameters.shardId, &parameters.shardCount, &rest) != 2 ||
+          parameters.shardCount < 1 || parameters.shardId < 1 || parameters.shardId > parameters.shardCount)
+      {
+        std::cerr << "Shard must be given as i/N, with 1 <= i <= N\n";
+        exit(1);
+      }
+
+      if (parameters.matrixOutput || parameters.binaryOutput)
+      {
+        std::cerr << "--matrix and --binaryOutput can not be used with --shard, use them with 'fastANI merge' instead\n";
+        exit(1);
+      }
+    }
+
     if (refName != "")
       parameters.refSequences.push_back(refName);
-    else
+    else if (refList != "")
       parseFileList(refList, parameters.refSequences);
 
     if (qryName != "")
@@ -214,16 +281,371 @@ namespace skch
 
     assert(parameters.minFraction >= 0.0 && parameters.minFraction <= 1.0);
 
+    if (parameters.refIndex != "")
+    {
+      //Sketching parameters and reference genome list come from the index
+      skch::RefIndex::readHeader(parameters.refIndex, parameters);
+    }
+    else
+    {
+      if (parameters.rollingHash && parameters.kmerSize > 16)
+      {
+        std::cerr << "Kmer size must be <= 16 with --rollingHash\n";
+        exit(1);
+      }
+
+      //Compute optimal window size
+      parameters.windowSize = skch::Stat::recommendedWindowSize(parameters.p_value,
+          parameters.kmerSize, parameters.alphabetSize,
+          parameters.percentageIdentity,
+          parameters.minReadLength, parameters.referenceSize);
+    }
+
+    printCmdOptions(parameters);
+
+    //Check if files are valid
+    validateInputFiles(parameters.querySequences, parameters.refSequences, parameters.refIndex != "");
+  }
+
+  /**
+   * @brief                   Parse the cmd line options of 'fastANI index'
+   * @param[in]   cmd         arguments following 'index'
+   * @param[out]  parameters  sketch parameters are saved here
+   */
+  void parseandSaveIndex(int argc, char** argv, 
+      skch::Parameters &parameters)
+  {
+    //defaults, same as the ones used for mapping
+    parameters.kmerSize = 16;
+    parameters.minReadLength = 3000;
+    parameters.alphabetSize = 4;
+    parameters.threads = 1;
+    parameters.p_value = 1e-03;
+    parameters.percentageIdentity = 80;
+    parameters.referenceSize = 5000000;
+    parameters.minFraction = 0.2;
+    parameters.visualize = false;
+    parameters.matrixOutput = false;
+    parameters.reportAll = true;
+    parameters.rollingHash = false;
+
+    std::string refName, refList;
+    bool help = false;
+
+    auto help_cmd = clipp::option("-h", "--help").set(help).doc("print this help page");
+    auto ref_cmd = (clipp::option("-r", "--ref") & clipp::value("value", refName)) % "reference genome (fasta/fastq)[.gz]";
+    auto refList_cmd = (clipp::option("--rl", "--refList") & clipp::value("value", refList)) % "a file containing list of reference genome files, one genome per line";
+    auto kmer_cmd = (clipp::option("-k", "--kmer") & clipp::value("value", parameters.kmerSize)) % "kmer size <= 16 [default : 16]";
+    auto rollingHash_cmd = clipp::option("--rollingHash").set(parameters.rollingHash).doc("hash kmers with a rolling 2-bit canonical hash instead of murmur3, faster to sketch. Kmers containing non-ACGT characters are skipped. Sketches and ANI values differ slightly from the default [disabled by default]");
+    auto thread_cmd = (clipp::option("-t", "--threads") & clipp::value("value", parameters.threads)) % "thread count for parallel execution, reference genomes are indexed in 4 blocks per thread [default : 1]";
+    auto fraglen_cmd = (clipp::option("--fragLen") & clipp::value("value", parameters.minReadLength)) % "fragment length [default : 3,000]";
+    auto output_cmd = (clipp::option("-o", "--output") & clipp::value("value", parameters.outFileName)) % "output index file name";
+
+    auto cli =
+      (
+       help_cmd,
+       ref_cmd,
+       refList_cmd,
+       kmer_cmd,
+       rollingHash_cmd,
+       thread_cmd,
+       fraglen_cmd,
+       output_cmd
+      );
+
+    //with formatting options
+    auto fmt = clipp::doc_formatting{}
+    .first_column(0)
+      .doc_column(5)
+      .last_column(80);
+
+    std::string description = "fastANI index saves the sketch of reference genomes, to be reused with --refIndex\n-----------------\nExample usage:\n$ fastANI index --rl genome_list.txt -o genomes.idx";
+
+    if(!clipp::parse(argc, argv, cli) || help)
+    {
+      clipp::operator<<(std::cout, clipp::make_man_page(cli, "fastANI index", fmt).prepend_section("-----------------", description)) << std::endl;
+      exit(help ? 0 : 1);
+    }
+
+    if ((refName == "" && refList == "") || parameters.outFileName == "")
+    {
+      std::cerr << "Provide reference file (s) and output index file name\n";
+      exit(1);
+    }
+
+    if (refName != "")
+      parameters.refSequences.push_back(refName);
+    else
+      parseFileList(refList, parameters.refSequences);
+
+    if (parameters.rollingHash && parameters.kmerSize > 16)
+    {
+      std::cerr << "Kmer size must be <= 16 with --rollingHash\n";
+      exit(1);
+    }
+
     //Compute optimal window size
     parameters.windowSize = skch::Stat::recommendedWindowSize(parameters.p_value,
         parameters.kmerSize, parameters.alphabetSize,
         parameters.percentageIdentity,
         parameters.minReadLength, parameters.referenceSize);
 
-    printCmdOptions(parameters);
+    std::cerr << ">>>>>>>>>>>>>>>>>>" << std::endl;
+    std::cerr << "Reference = " << parameters.refSequences << std::endl;
+    std::cerr << "Kmer size = " << parameters.kmerSize << std::endl;
+    std::cerr << "Kmer hash = " << (parameters.rollingHash ? "rolling 2-bit" : "murmur3") << std::endl;
+    std::cerr << "Fragment length = " << parameters.minReadLength << std::endl;
+    std::cerr << "Threads = " << parameters.threads << std::endl;
+    std::cerr << "Index output file = " << parameters.outFileName << std::endl;
+    std::cerr << ">>>>>>>>>>>>>>>>>>" << std::endl;
 
-    //Check if files are valid
-    validateInputFiles(parameters.querySequences, parameters.refSequences);
+    validateFileList(parameters.refSequences);
+  }
+
+  /**
+   * @brief                   Parse the cmd line options of 'fastANI merge'
+   * @param[in]   cmd         arguments following 'merge'
+   * @param[out]  parameters  genome lists, output file name and matrix option are saved here
+   * @param[out]  shardFiles  outputs of the shards to merge
+   */
+  void parseandSaveMerge(int argc, char** argv, 
+      skch::Parameters &parameters,
+      std::vector<std::string> &shardFiles)
+  {
+    parameters.matrixOutput = false;
+    parameters.binaryOutput = false;
+
+    std::string refName, refList;
+    std::string qryName, qryList;
+    bool help = false;
+
+    auto help_cmd = clipp::option("-h", "--help").set(help).doc("print this help page");
+    auto ref_cmd = (clipp::option("-r", "--ref") & clipp::value("value", refName)) % "reference genome, as given to the shards";
+    auto refList_cmd = (clipp::option("--rl", "--refList") & clipp::value("value", refList)) % "reference genome list, as given to the shards";
+    auto refIndex_cmd = (clipp::option("--refIndex") & clipp::value("value", parameters.refIndex)) % "reference index, as given to the shards";
+    auto qry_cmd = (clipp::option("-q", "--query") & clipp::value("value", qryName)) % "query genome, as given to the shards";
+    auto qryList_cmd = (clipp::option("--ql", "--queryList") & clipp::value("value", qryList)) % "query genome list, as given to the shards";
+    auto matrix_cmd = clipp::option("--matrix").set(parameters.matrixOutput).doc("also output ANI values as lower triangular matrix, same as --matrix of an unsharded run [disabled by default]");
+    auto output_cmd = (clipp::option("-o", "--output") & clipp::value("value", parameters.outFileName)) % "output file name";
+    auto binary_cmd = clipp::option("--binaryOutput").set(parameters.binaryOutput).doc("write output in binary format, same as --binaryOutput of an unsharded run [disabled by default]");
+    auto shards_cmd = clipp::values("shard outputs", shardFiles).blocking(false) % "output files of all shards of the run";
+
+    auto cli =
+      (
+       help_cmd,
+       ref_cmd,
+       refList_cmd,
+       refIndex_cmd,
+       qry_cmd,
+       qryList_cmd,
+       matrix_cmd,
+       output_cmd,
+       binary_cmd,
+       shards_cmd
+      );
+
+    //with formatting options
+    auto fmt = clipp::doc_formatting{}
+    .first_column(0)
+      .doc_column(5)
+      .last_column(80);
+
+    std::string description = "fastANI merge combines the outputs of all shards of a run (--shard i/N) into the output of the whole run\n-----------------\nExample usage:\n$ fastANI merge --ql query_list.txt --rl genome_list.txt -o output.txt --matrix shard.1 shard.2 shard.3";
+
+    if(!clipp::parse(argc, argv, cli) || help)
+    {
+      clipp::operator<<(std::cout, clipp::make_man_page(cli, "fastANI merge", fmt).prepend_section("-----------------", description)) << std::endl;
+      exit(help ? 0 : 1);
+    }
+
+    if ((refName == "" && refList == "" && parameters.refIndex == "") || (qryName == "" && qryList == "") || 
+        parameters.outFileName == "" || shardFiles.empty())
+    {
+      std::cerr << "Provide query and reference genomes as given to the shards, output file name, and shard outputs\n";
+      exit(1);
+    }
+
+    if (refName != "")
+      parameters.refSequences.push_back(refName);
+    else if (refList != "")
+      parseFileList(refList, parameters.refSequences);
+    else
+      skch::RefIndex::readHeader(parameters.refIndex, parameters);
+
+    if (qryName != "")
+      parameters.querySequences.push_back(qryName);
+    else
+      parseFileList(qryList, parameters.querySequences);
+  }
+
+  /**
+   * @brief                   Parse the cmd line options of 'fastANI convert'
+   * @param[in]   cmd         arguments following 'convert'
+   * @param[out]  binaryFile  binary output to convert
+   * @param[out]  outFileName text output file name, empty for standard output
+   */
+  void parseandSaveConvert(int argc, char** argv, 
+      std::string &binaryFile,
+      std::string &outFileName)
+  {
+    bool help = false;
+
+    auto help_cmd = clipp::option("-h", "--help").set(help).doc("print this help page");
+    auto output_cmd = (clipp::option("-o", "--output") & clipp::value("value", outFileName)) % "text output file name [default : standard output]";
+    auto input_cmd = clipp::value("binary output", binaryFile).blocking(false) % "output file written with --binaryOutput";
+
+    auto cli =
+      (
+       help_cmd,
+       output_cmd,
+       input_cmd
+      );
+
+    //with formatting options
+    auto fmt = clipp::doc_formatting{}
+    .first_column(0)
+      .doc_column(5)
+      .last_column(80);
+
+    std::string description = "fastANI convert writes a binary output (--binaryOutput) in the default text format\n-----------------\nExample usage:\n$ fastANI convert output.bin -o output.txt";
+
+    if(!clipp::parse(argc, argv, cli) || help)
+    {
+      clipp::operator<<(std::cout, clipp::make_man_page(cli, "fastANI convert", fmt).prepend_section("-----------------", description)) << std::endl;
+      exit(help ? 0 : 1);
+    }
+  }
+
+  /**
+   * @brief                   Parse the cmd line options of 'fastANI serve'
+   * @param[in]   cmd         arguments following 'serve'
+   * @param[out]  parameters  sketch parameters and reference genome list of the index,
+   *                          minFraction and worker count are saved here
+   * @param[out]  socketPath  socket file to listen on
+   */
+  void parseandSaveServe(int argc, char** argv, 
+      skch::Parameters &parameters,
+      std::string &socketPath)
+  {
+    //defaults, same as the ones used for mapping
+    parameters.minFraction = 0.2;
+    parameters.threads = 1;
+    parameters.p_value = 1e-03;
+    parameters.referenceSize = 5000000;
+    parameters.visualize = false;
+    parameters.matrixOutput = false;
+    parameters.binaryOutput = false;
+    parameters.reportAll = true;
+    parameters.resume = false;
+    parameters.shardId = 0;
+    parameters.shardCount = 0;
+    parameters.prefilter = false;
+
+    bool help = false;
+
+    auto help_cmd = clipp::option("-h", "--help").set(help).doc("print this help page");
+    auto refIndex_cmd = (clipp::option("--refIndex") & clipp::value("value", parameters.refIndex)) % "reference index built using 'fastANI index', loaded once and used for all queries";
+    auto socket_cmd = (clipp::option("--socket") & clipp::value("value", socketPath)) % "Unix domain socket file to listen on";
+    auto thread_cmd = (clipp::option("-t", "--threads") & clipp::value("value", parameters.threads)) % "count of worker threads, each one maps a query genome at a time [default : 1]";
+    auto minfraction_cmd = (clipp::option("--minFraction") & clipp::value("value", parameters.minFraction)) % "minimum fraction of genome that must be shared for trusting ANI, as for mapping runs [default : 0.2]";
+
+    auto cli =
+      (
+       help_cmd,
+       refIndex_cmd,
+       socket_cmd,
+       thread_cmd,
+       minfraction_cmd
+      );
+
+    //with formatting options
+    auto fmt = clipp::doc_formatting{}
+    .first_column(0)
+      .doc_column(5)
+      .last_column(80);
+
+    std::string description = "fastANI serve keeps a reference index loaded, and maps query genomes sent by 'fastANI client' over a local socket\n-----------------\nExample usage:\n$ fastANI serve --refIndex genomes.idx --socket /tmp/fastani.sock -t 4\n$ fastANI client --socket /tmp/fastani.sock -q genome1.fa -o output.txt";
+
+    if(!clipp::parse(argc, argv, cli) || help || parameters.refIndex == "" || socketPath == "")
+    {
+      clipp::operator<<(std::cout, clipp::make_man_page(cli, "fastANI serve", fmt).prepend_section("-----------------", description)) << std::endl;
+      exit(help ? 0 : 1);
+    }
+
+    if (parameters.threads < 1)
+    {
+      std::cerr << "Worker thread count must be at least 1\n";
+      exit(1);
+    }
+
+    assert(parameters.minFraction >= 0.0 && parameters.minFraction <= 1.0);
+
+    //Sketching parameters and reference genome list come from the index
+    skch::RefIndex::readHeader(parameters.refIndex, parameters);
+
+    std::cerr << ">>>>>>>>>>>>>>>>>>" << std::endl;
+    std::cerr << "Reference index = " << parameters.refIndex << std::endl;
+    std::cerr << "Kmer size = " << parameters.kmerSize << std::endl;
+    std::cerr << "Kmer hash = " << (parameters.rollingHash ? "rolling 2-bit" : "murmur3") << std::endl;
+    std::cerr << "Fragment length = " << parameters.minReadLength << std::endl;
+    std::cerr << "Worker threads = " << parameters.threads << std::endl;
+    std::cerr << "Socket = " << socketPath << std::endl;
+    std::cerr << ">>>>>>>>>>>>>>>>>>" << std::endl;
+  }
+
+  /**
+   * @brief                   Parse the cmd line options of 'fastANI client'
+   * @param[in]   cmd         arguments following 'client'
+   * @param[out]  parameters  query genome list and output file name are saved here
+   * @param[out]  socketPath  socket of the server
+   * @param[out]  upload      send genome contents instead of paths
+   */
+  void parseandSaveClient(int argc, char** argv, 
+      skch::Parameters &parameters,
+      std::string &socketPath,
+      bool &upload)
+  {
+    std::string qryName, qryList;
+    bool help = false;
+    upload = false;
+
+    auto help_cmd = clipp::option("-h", "--help").set(help).doc("print this help page");
+    auto socket_cmd = (clipp::option("--socket") & clipp::value("value", socketPath)) % "socket of a running 'fastANI serve'";
+    auto qry_cmd = (clipp::option("-q", "--query") & clipp::value("value", qryName)) % "query genome (fasta/fastq)[.gz]";
+    auto qryList_cmd = (clipp::option("--ql", "--queryList") & clipp::value("value", qryList)) % "a file containing list of query genome files, one genome per line";
+    auto upload_cmd = clipp::option("--upload").set(upload).doc("send genome contents instead of file paths, for servers that can not read the query files [disabled by default]");
+    auto output_cmd = (clipp::option("-o", "--output") & clipp::value("value", parameters.outFileName)) % "output file name [default : standard output]";
+
+    auto cli =
+      (
+       help_cmd,
+       socket_cmd,
+       qry_cmd,
+       qryList_cmd,
+       upload_cmd,
+       output_cmd
+      );
+
+    //with formatting options
+    auto fmt = clipp::doc_formatting{}
+    .first_column(0)
+      .doc_column(5)
+      .last_column(80);
+
+    std::string description = "fastANI client maps query genomes using a running 'fastANI serve', and writes the results in the default output format\n-----------------\nExample usage:\n$ fastANI client --socket /tmp/fastani.sock -q genome1.fa -o output.txt";
+
+    if(!clipp::parse(argc, argv, cli) || help || socketPath == "" || (qryName == "" && qryList == ""))
+    {
+      clipp::operator<<(std::cout, clipp::make_man_page(cli, "fastANI client", fmt).prepend_section("-----------------", description)) << std::endl;
+      exit(help ? 0 : 1);
+    }
+
+    if (qryName != "")
+      parameters.querySequences.push_back(qryName);
+    else
+      parseFileList(qryList, parameters.querySequences);
+
+    validateFileList(parameters.querySequences);
   }
 }
 
@@ -0,0 +1,192 @@
+/**
+ * @file    querySketch.hpp
+ * @brief   routines to sketch the fragments of a query genome
+ */
+
+#ifndef QUERY_SKETCH_HPP
+#define QUERY_SKETCH_HPP
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <zlib.h>
+
+//Own includes
+#include "map/include/base_types.hpp"
+#include "map/include/map_parameters.hpp"
+#include "map/include/commonFunc.hpp"
+#include "map/include/winSketch.hpp"
+#include "map/include/genomeReader.hpp"
+
+//External includes
+#include "common/kseq.h"
+
+namespace skch
+{
+  /**
+   * @class     skch::QuerySketch
+   * @brief     splits a query genome into fragments and sketches each fragment
+   * @details   Sketch is computed once per query genome, and mapped read-only against
+   *            any number of reference sketches (possibly by multiple threads)
+   *            Minimizers of each fragment are kept sorted by hash and unique,
+   *            as required for L1 and L2 mapping stages
+   */
+  class QuerySketch
+  {
+    public:
+
+      //Container type for saving fragment sketches
+      typedef Sketch::MI_Type MinVec_Type;
+
+      typedef QueryMetaData <MinVec_Type> Fragment_t;
+
+      //Sketches of all fragments, in the order they appear in the query genome
+      std::vector< Fragment_t > fragments;
+
+      //Keep sequence length, name that appear in the contigs to compute global offsets
+      //Optionally used if visualization is enabled
+      std::vector< ContigInfo > metadata;
+
+      //Count of total sequence fragments in query genome
+      uint64_t totalQueryFragments = 0;
+
+      //Genome length, counting only sequences of at least fragment length, each 
+      //rounded down to a multiple of fragment length
+      uint64_t genomeLength = 0;
+
+      QuerySketch() = default;
+
+      /**
+       * @brief                   constructor, sketches the query genome
+       * @param[in]   p           algorithm parameters
+       * @param[in]   fileName    query genome
+       */
+      QuerySketch(const skch::Parameters &p, const std::string &fileName)
+      {
+        this->build(p, fileName);
+      }
+
+      /**
+       * @brief                   parse over sequences in query file, split them into
+       *                          fragments and compute sketch of each fragment
+       * @param[in]   param       algorithm parameters
+       * @param[in]   fileName    query genome
+       */
+      void build(const skch::Parameters &param, const std::string &fileName)
+      {
+#ifdef DEBUG
+        std::cerr << "INFO, skch::QuerySketch::build, sketching reads in " << fileName << std::endl;
+#endif
+
+        ParsedGenome genome;
+        genome.read(fileName);
+
+        this->build(param, genome);
+      }
+
+      /**
+       * @brief                   split sequences of an already parsed query genome into
+       *                          fragments and compute sketch of each fragment
+       * @param[in]   param       algorithm parameters
+       * @param[in]   genome      query genome, sequences are converted to upper case in place
+       */
+      void build(const skch::Parameters &param, ParsedGenome &genome)
+      {
+        //Count of fragments sketched by us
+        //Some reads are dropped because of short length
+        seqno_t seqCounter = 0;
+
+        for(auto &record : genome.records)
+        {
+          SequenceRecord *seq = &record;
+
+          //size of sequence
+          offset_t len = seq->seq.l;
+
+          //How many query fragments did we consider mapping?
+          int fragmentCount = 0;
+
+          if(len >= param.minReadLength)
+            genomeLength += ((uint64_t)len / param.minReadLength) * param.minReadLength;
+
+          //Is the read too short?
+          if(len < param.windowSize || len < param.kmerSize || len < param.minReadLength)
+          {
+            fragmentCount = 0;
+
+            //Record contig length
+            if(param.visualize)
+              metadata.push_back( ContigInfo{seq->name.s, (offset_t)seq->seq.l} );
+
+#ifdef DEBUG
+            std::cerr << "WARNING, skch::QuerySketch::build, read is not long enough for mapping" << std::endl;
+#endif
+          }
+          else
+          {
+            fragmentCount = len / param.minReadLength;
+
+            for (int i = 0; i < fragmentCount; i++)
+            {
+              //Record each fragment's length coverage in genome for supporting visualization
+              if(param.visualize)
+              {
+                if (i != fragmentCount - 1)
+                  metadata.push_back( ContigInfo{seq->name.s, param.minReadLength} );
+                else //Adjust for unmapped tail sequence
+                  metadata.push_back( ContigInfo{seq->name.s, param.minReadLength + (len % param.minReadLength)} );
+              }
+
+              auto seqCopy = *seq;
+              seqCopy.seq.s = seq->seq.s + i * param.minReadLength;
+              seqCopy.seq.l = param.minReadLength;
+
+              fragments.emplace_back();
+
+              Fragment_t &Q = fragments.back();
+              Q.len = param.minReadLength;
+              Q.seqCounter = seqCounter + i;
+
+              sketchFragment(param, &seqCopy, Q);
+            }
+          }
+
+          seqCounter += fragmentCount;
+          totalQueryFragments += fragmentCount;
+        }
+      }
+
+    private:
+
+      /**
+       * @brief                   compute minimizers of a fragment, and keep its sketch
+       *                          for estimating jaccard as unique minimizers sorted by hash
+       * @param[in]   param       algorithm parameters
+       * @param[in]   kseq        fragment sequence
+       * @param[out]  Q           fragment sketch
+       */
+      template <typename KSEQ>
+        static void sketchFragment(const skch::Parameters &param, KSEQ kseq, Fragment_t &Q)
+        {
+          CommonFunc::addMinimizers(Q.minimizerTableQuery, kseq, param.kmerSize, param.windowSize, param.alphabetSize, param.rollingHash);
+
+#ifdef DEBUG
+          std::cerr << "INFO, skch::QuerySketch::sketchFragment, read id " << Q.seqCounter << ", minimizer count = " << Q.minimizerTableQuery.size() << "\n";
+#endif
+
+          std::sort(Q.minimizerTableQuery.begin(), Q.minimizerTableQuery.end(), MinimizerInfo::lessByHash);
+
+          //note : unique preserves the original relative order of elements
+          auto uniqEndIter = std::unique(Q.minimizerTableQuery.begin(), Q.minimizerTableQuery.end(), MinimizerInfo::equalityByHash);
+
+          //Duplicates are not needed for mapping, release them
+          Q.minimizerTableQuery.erase(uniqEndIter, Q.minimizerTableQuery.end());
+          Q.minimizerTableQuery.shrink_to_fit();
+
+          //This is the sketch size for estimating jaccard
+          Q.sketchSize = Q.minimizerTableQuery.size();
+        }
+  };
+}
+
+#endif
@@ -0,0 +1,327 @@
+/**
+ * @file    refIndex.hpp
+ * @brief   routines to save reference sketches to disk once and load them
+ *          in later runs, instead of re-parsing the reference genomes
+ */
+
+#ifndef REF_INDEX_HPP
+#define REF_INDEX_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Own includes
+#include "map/include/base_types.hpp"
+#include "map/include/map_parameters.hpp"
+#include "map/include/commonFunc.hpp"
+#include "map/include/winSketch.hpp"
+#include "map/include/genomeReader.hpp"
+
+namespace skch
+{
+  /**
+   * @namespace skch::RefIndex
+   * @brief     Reference index file, layout:
+   *            1.  header: magic, format version, kmer hash tag, sketching parameters
+   *                and the list of reference genomes
+   *            2.  sketches of the reference partitions in flat layout, see Sketch::save(),
+   *                each one 64-byte aligned
+   *            3.  footer: byte offset of each partition sketch, global id of the first 
+   *                reference genome of each partition (followed by count of reference genomes),
+   *                partition count
+   *            Partitions are contiguous blocks of reference genomes
+   *            Index file is memory-mapped read-only and sketches are used in place,
+   *            so pages are shared among all processes using the same index
+   */
+  namespace RefIndex
+  {
+    const char magic[8] = {'F', 'A', 'N', 'I', 'I', 'D', 'X', '\0'};
+
+    //Revise this whenever the layout or the sketch values change
+    const uint32_t formatVersion = 5;
+
+    //Tags of the kmer hash functions, sketch values of one are meaningless to the other
+    const uint32_t hashTagMurmur3 = 1;
+    const uint32_t hashTagRolling2Bit = 2;
+
+    /**
+     * @brief                   write index header
+     * @param[in]   out
+     * @param[in]   parameters  sketching parameters and complete list of reference genomes
+     */
+    inline void writeHeader(std::ostream &out, const skch::Parameters &parameters)
+    {
+      out.write(magic, sizeof(magic));
+      CommonFunc::writePod(out, formatVersion);
+      CommonFunc::writePod(out, parameters.rollingHash ? hashTagRolling2Bit : hashTagMurmur3);
+      CommonFunc::writePod(out, parameters.kmerSize);
+      CommonFunc::writePod(out, parameters.windowSize);
+      CommonFunc::writePod(out, parameters.minReadLength);
+      CommonFunc::writePod(out, parameters.alphabetSize);
+      CommonFunc::writePod(out, parameters.percentageIdentity);
+
+      CommonFunc::writePod<uint64_t>(out, parameters.refSequences.size());
+      for(auto &e : parameters.refSequences)
+        CommonFunc::writeString(out, e);
+    }
+
+    /**
+     * @brief                   read index header, and revise parameters
+     *                          that must match the ones used for indexing
+     * @param[in]   fileName    index file
+     * @param[out]  parameters  sketching parameters and reference genome list are overwritten
+     */
+    inline void readHeader(const std::string &fileName, skch::Parameters &parameters)
+    {
+      std::ifstream in(fileName, std::ios::binary);
+
+      if (in.fail())
+      {
+        std::cerr << "ERROR, skch::RefIndex::readHeader, Could not open " << fileName << std::endl;
+        exit(1);
+      }
+
+      char fileMagic[sizeof(magic)] = {};
+      uint32_t version = 0;
+      uint32_t hashTag = 0;
+
+      in.read(fileMagic, sizeof(fileMagic));
+      CommonFunc::readPod(in, version);
+
+      if (!in || memcmp(fileMagic, magic, sizeof(magic)) != 0)
+      {
+        std::cerr << "ERROR, skch::RefIndex::readHeader, " << fileName << " is not a fastANI reference index" << std::endl;
+        exit(1);
+      }
+
+      if (version != formatVersion)
+      {
+        std::cerr << "ERROR, skch::RefIndex::readHeader, " << fileName << " has index format version " << version
+          << ", expected " << formatVersion << ". Please rebuild the index" << std::endl;
+        exit(1);
+      }
+
+      CommonFunc::readPod(in, hashTag);
+
+      if (hashTag != hashTagMurmur3 && hashTag != hashTagRolling2Bit)
+      {
+        std::cerr << "ERROR, skch::RefIndex::readHeader, " << fileName << " uses unknown kmer hash " << hashTag << std::endl;
+        exit(1);
+      }
+
+      parameters.rollingHash = (hashTag == hashTagRolling2Bit);
+
+      CommonFunc::readPod(in, parameters.kmerSize);
+      CommonFunc::readPod(in, parameters.windowSize);
+      CommonFunc::readPod(in, parameters.minReadLength);
+      CommonFunc::readPod(in, parameters.alphabetSize);
+      CommonFunc::readPod(in, parameters.percentageIdentity);
+
+      uint64_t refCount = 0;
+      CommonFunc::readPod(in, refCount);
+
+      parameters.refSequences.resize(refCount);
+      for(auto &e : parameters.refSequences)
+        CommonFunc::readString(in, e);
+
+      if (!in)
+      {
+        std::cerr << "ERROR, skch::RefIndex::readHeader, " << fileName << " is truncated or corrupt" << std::endl;
+        exit(1);
+      }
+    }
+
+    /**
+     * @class     skch::RefIndex::MappedFile
+     * @brief     read-only memory mapping of a reference index file
+     */
+    class MappedFile
+    {
+      private:
+
+        const char *base = nullptr;
+        uint64_t size = 0;
+
+        //Byte offset of the sketch of each partition
+        const uint64_t *partitionOffsets = nullptr;
+        uint64_t partitionCount = 0;
+
+        //Global id of the first reference genome of each partition
+        const uint64_t *partitionGenomeBegin = nullptr;
+
+      public:
+
+        MappedFile() = default;
+        MappedFile(const MappedFile &) = delete;
+        MappedFile & operator=(const MappedFile &) = delete;
+
+        ~MappedFile()
+        {
+          if (base != nullptr)
+            munmap((void *)base, size);
+        }
+
+        /**
+         * @brief                 map the index file, locate partitions using its footer
+         *                        and check that each partition sketch fits in the file
+         * @param[in] fileName
+         * @param[in] refGenomeCount  count of reference genomes in the index header
+         */
+        void open(const std::string &fileName, uint64_t refGenomeCount)
+        {
+          int fd = ::open(fileName.c_str(), O_RDONLY);
+          struct stat st;
+
+          if (fd < 0 || fstat(fd, &st) != 0)
+          {
+            std::cerr << "ERROR, skch::RefIndex::MappedFile::open, Could not open " << fileName << std::endl;
+            exit(1);
+          }
+
+          size = st.st_size;
+          void *addr = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+          close(fd);
+
+          if (addr == MAP_FAILED)
+          {
+            std::cerr << "ERROR, skch::RefIndex::MappedFile::open, Could not memory-map " << fileName << std::endl;
+            exit(1);
+          }
+
+          base = static_cast<const char *>(addr);
+
+          if (size >= sizeof(uint64_t))
+            memcpy(&partitionCount, base + size - sizeof(uint64_t), sizeof(uint64_t));
+
+          if (partitionCount == 0 || (2 * partitionCount + 2) * sizeof(uint64_t) > size)
+          {
+            std::cerr << "ERROR, skch::RefIndex::MappedFile::open, " << fileName << " is truncated or corrupt" << std::endl;
+            exit(1);
+          }
+
+          uint64_t footerPos = size - (2 * partitionCount + 2) * sizeof(uint64_t);
+
+          partitionOffsets = reinterpret_cast<const uint64_t *>(base + footerPos);
+          partitionGenomeBegin = partitionOffsets + partitionCount;
+
+          bool valid = (footerPos % 8 == 0 && partitionGenomeBegin[0] == 0 
+              && partitionGenomeBegin[partitionCount] == refGenomeCount);
+
+          //Partitions are written in order, each one ends where the next one begins
+          for (uint64_t i = 0; valid && i < partitionCount; i++)
+          {
+            uint64_t end = (i + 1 < partitionCount) ? partitionOffsets[i+1] : footerPos;
+
+            valid = partitionOffsets[i] % 64 == 0 && partitionOffsets[i] <= end && end <= footerPos
+              && partitionGenomeBegin[i] <= partitionGenomeBegin[i+1]
+              && skch::Sketch::checkFlatLayout(base + partitionOffsets[i], end - partitionOffsets[i])
+              && reinterpret_cast<const skch::Sketch::FlatLayout *>(base + partitionOffsets[i])->genomeCount 
+                  == partitionGenomeBegin[i+1] - partitionGenomeBegin[i];
+          }
+
+          if (!valid)
+          {
+            std::cerr << "ERROR, skch::RefIndex::MappedFile::open, " << fileName << " is truncated or corrupt" << std::endl;
+            exit(1);
+          }
+        }
+
+        uint64_t getPartitionCount() const
+        {
+          return partitionCount;
+        }
+
+        /**
+         * @brief                   reference genome ranges of the partitions
+         * @param[out]  refGenomeBegin  global id of the first reference genome of each partition,
+         *                              followed by the count of reference genomes
+         */
+        void getPartitionGenomeBegin(std::vector<uint64_t> &refGenomeBegin) const
+        {
+          refGenomeBegin.assign(partitionGenomeBegin, partitionGenomeBegin + partitionCount + 1);
+        }
+
+        /**
+         * @brief                   sketch of a reference partition, used in place
+         * @param[in]   p           parameters of the partition, kept by reference inside the sketch
+         * @param[in]   partition
+         * @return                  reference sketch
+         */
+        skch::Sketch loadPartition(const skch::Parameters &p, uint64_t partition) const
+        {
+          return skch::Sketch(p, base + partitionOffsets[partition]);
+        }
+    };
+
+    /**
+     * @brief                         sketch the reference partitions in parallel and save them
+     *                                to index file parameters.outFileName
+     * @param[in]   parameters        sketching parameters and complete list of reference genomes
+     * @param[in]   parameters_split  parameters for each reference partition
+     * @param[in]   refGenomeBegin    global id of the first reference genome of each partition,
+     *                                followed by the count of reference genomes
+     */
+    inline void build(const skch::Parameters &parameters, 
+        const std::vector <skch::Parameters> &parameters_split,
+        const std::vector <uint64_t> &refGenomeBegin)
+    {
+      std::ofstream out(parameters.outFileName, std::ios::binary);
+
+      if (out.fail())
+      {
+        std::cerr << "ERROR, skch::RefIndex::build, Could not open " << parameters.outFileName << " for writing" << std::endl;
+        exit(1);
+      }
+
+      writeHeader(out, parameters);
+
+      std::vector<uint64_t> partitionOffsets (parameters_split.size());
+
+      static const char padding[64] = {};
+
+      //Reference genomes are read and decompressed ahead of the sketching threads
+      GenomeReader reader (parameters.refSequences, GenomeReader::threadCount(parameters.threads), 
+          GenomeReader::defaultBufferSize);
+
+#pragma omp parallel for ordered schedule(dynamic,1)
+      for (uint64_t i = 0; i < parameters_split.size(); i++)
+      {
+        skch::Sketch referSketch(parameters_split[i], &reader, refGenomeBegin[i]);
+
+        //Partitions are written in order, while sketching happens in parallel
+#pragma omp ordered
+        {
+          out.write(padding, (64 - out.tellp() % 64) % 64);
+          partitionOffsets[i] = out.tellp();
+          referSketch.save(out);
+        }
+      }
+
+      //Footer is 8-byte aligned, it is read in place
+      out.write(padding, (8 - out.tellp() % 8) % 8);
+      out.write(reinterpret_cast<const char *>(partitionOffsets.data()), partitionOffsets.size() * sizeof(uint64_t));
+      out.write(reinterpret_cast<const char *>(refGenomeBegin.data()), refGenomeBegin.size() * sizeof(uint64_t));
+      CommonFunc::writePod<uint64_t>(out, partitionOffsets.size());
+
+      out.close();
+
+      if (out.fail())
+      {
+        std::cerr << "ERROR, skch::RefIndex::build, Failed to write " << parameters.outFileName << std::endl;
+        exit(1);
+      }
+
+      std::cerr << "INFO, skch::RefIndex::build, saved " << parameters.refSequences.size() << " reference genomes in "
+        << parameters_split.size() << " partitions to " << parameters.outFileName << std::endl;
+    }
+  }
+}
+
+#endif
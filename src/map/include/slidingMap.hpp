@@ -1,15 +1,15 @@
 /**
  * @file    slidingMap.hpp
- * @brief   implements ordered map to compute Jaccard
+ * @brief   implements rank-indexed sliding window to compute Jaccard
  * @author  Chirag Jain <cjain7@gatech.edu>
  */
 
-#ifndef SLIDING_MAP_HPP 
+#ifndef SLIDING_MAP_HPP
 #define SLIDING_MAP_HPP
 
 #include <vector>
 #include <algorithm>
-#include <map>
+#include <cassert>
 
 //Own includes
 #include "map/include/base_types.hpp"
@@ -20,7 +20,14 @@ namespace skch
 {
   /**
    * @class     skch::SlideMapper
-   * @brief     L1 and L2 mapping stages
+   * @brief     L2 mapping stage, tracks count of shared sketch elements between the
+   *            query sketch and a reference window sliding over an L1 candidate
+   * @details   Hashes of the query sketch and of the reference minimizers in the
+   *            candidate range are ranked once per candidate. Window contents are then
+   *            kept as per-rank occurrence counts and a presence bitset, instead of an
+   *            ordered map of hashes. Pivot is the rank of the 's'th smallest hash among
+   *            the query sketch and the reference window, same as in the ordered map.
+   *            Buffers are reused across candidates and query fragments
    */
   template <typename Q_Info>
     class SlideMapper
@@ -28,190 +35,165 @@ namespace skch
 
       private:
 
-        //Metadata for the minimizers saved in sliding ordered map during L2 stage
-        struct slidingMapContainerValueType
-        {
-          offset_t wposQ;                   //wpos of minimizers in the query
-          offset_t wposR;                   //wpos of minimizers in the reference
-        };
-
-        //Container type for saving read sketches during L1 and L2 both
-        typedef Sketch::MI_Type MinVec_Type;
-
         typedef Sketch::MIIter_t MIIter_t;
 
-        //reference to query's metadata
-        const Q_Info &Q;
+        //First minimizer of the candidate range, ranks are indexed relative to it
+        MIIter_t rangeBegin = nullptr;
 
-        //Define a Not available position marker
-        static const offset_t NAPos = std::numeric_limits<offset_t>::max();
+        //(hash, position in candidate range) of reference minimizers, sorted by hash
+        std::vector< std::pair<hash_t, offset_t> > rangeHashes;
 
-        //Ordered map to save unique sketch elements, and associated value as 
-        //a pair of its occurrence in the query and the reference
-        typedef std::map< hash_t, slidingMapContainerValueType > MapType;
-        MapType slidingWindowMinhashes;
+        //Rank of each reference minimizer in the candidate range
+        std::vector<offset_t> rankOfRef;
 
-        //Iterator pointing to the smallest 's'th element in the map
-        typename MapType::iterator pivot;
+        //Count of reference minimizers with each rank in the current window
+        std::vector<offset_t> refCount;
 
-        //Label status while inserting reference minimizer
-        enum IN : int
-        {
-          //reference minimizer is inserted into map as a new map entry
-          UNIQ = 1,
-
-          //reference minimizer is coupled with a query minimizer, 
-          //previously, there was no ref. minimizer at this entry
-          CPLD = 2, 
+        //Bitsets over ranks: hash is in the query sketch, hash is in the query sketch
+        //or in the current window
+        std::vector<uint64_t> queryRanks;
+        std::vector<uint64_t> presentRanks;
 
-          //ref. minimizer just revises the hash position of already 
-          //existing reference minimizer
-          REV = 3
-        };  
-
-        //Label status while deleting reference minimizer
-        enum OUT : int
-        {
-          //entry in the map is deleted
-          DEL = 1,
-
-          //just the reference minimizer is updated to null
-          UPD = 2,
-
-          //Nothing changed in the map
-          NOOP = 3
-        };
+        //Rank of the smallest 's'th present hash
+        offset_t pivot = 0;
 
       public:
 
         //Count of shared sketch elements between query and the reference
-        //Updated after insert or delete operation on map 
-        int sharedSketchElements;
-
-
-        //Delete default constructor
-        SlideMapper() = delete;
+        //Updated after insert or delete operation
+        int sharedSketchElements = 0;
 
         /**
-         * @brief                 constructor
+         * @brief                 rank the query sketch and the reference minimizers of
+         *                        an L1 candidate, and start with an empty reference window
          * @param[in]   Q         query meta data
+         * @param[in]   begin     first reference minimizer of the candidate
+         * @param[in]   end       end of reference minimizers that may enter the window
          */
-        SlideMapper(Q_Info &Q_) :
-          Q(Q_),
-          pivot(this->slidingWindowMinhashes.end()),
-          sharedSketchElements(0)
+        inline void reset(const Q_Info &Q, MIIter_t begin, MIIter_t end)
         {
-          this->init();
-        }
+          offset_t refCountInRange = std::distance(begin, end);
 
-      private:
+          this->rangeBegin = begin;
 
-        /**
-         * @brief       Fills map with minimum 's' minimizers in the query
-         */
-        inline void init()
-        {
-          //Range of sketch in query
-          //Assuming unique query minimizers were placed at the start during L1 mapping
-          auto uniqEndIter = std::next(Q.minimizerTableQuery.begin(), Q.sketchSize);
+          this->rangeHashes.clear();
+          for(offset_t i = 0; i < refCountInRange; i++)
+            this->rangeHashes.emplace_back(begin[i].hash, i);
+
+          std::sort(this->rangeHashes.begin(), this->rangeHashes.end());
 
-          //Insert query sketch elements to map
-          for(auto it = Q.minimizerTableQuery.begin(); it != uniqEndIter; it++)
+          this->rankOfRef.resize(refCountInRange);
+
+          //Upper bound on count of distinct hashes
+          offset_t words = (Q.sketchSize + refCountInRange + 63) / 64;
+          this->queryRanks.assign(words, 0);
+
+          //Merge unique query minimizers (sorted by hash) with reference hashes
+          offset_t rank = 0;
+          int qi = 0;
+          offset_t ri = 0;
+
+          while(qi < Q.sketchSize || ri < refCountInRange)
           {
-            this->slidingWindowMinhashes.emplace_hint(slidingWindowMinhashes.end(), it->hash, slidingMapContainerValueType{it->wpos, NAPos});
-          }
+            hash_t h;
 
-          //Point pivot to last element in the map
-          this->pivot = std::next(this->slidingWindowMinhashes.begin(), Q.sketchSize - 1);
+            if(ri == refCountInRange || (qi < Q.sketchSize && Q.minimizerTableQuery[qi].hash <= this->rangeHashes[ri].first))
+              h = Q.minimizerTableQuery[qi].hash;
+            else
+              h = this->rangeHashes[ri].first;
 
-          //Current count of shared sketch elements is zero
+            if(qi < Q.sketchSize && Q.minimizerTableQuery[qi].hash == h)
+            {
+              this->queryRanks[rank / 64] |= 1ULL << (rank % 64);
+              this->pivot = rank;
+              qi++;
+            }
+
+            for(; ri < refCountInRange && this->rangeHashes[ri].first == h; ri++)
+              this->rankOfRef[this->rangeHashes[ri].second] = rank;
+
+            rank++;
+          }
+
+          //Pivot is at the largest query hash
+          this->refCount.assign(rank, 0);
+          this->presentRanks = this->queryRanks;
           this->sharedSketchElements = 0;
         }
 
-      public:
-
         /**
-         * @brief               insert a minimizer from the reference sequence into the map
+         * @brief               insert a minimizer from the reference sequence into the window
          * @param[in]   m       reference minimizer to insert
          */
         inline void insert_ref(MIIter_t m)
         {
-          hash_t hashVal = m->hash;
-          int status;
+          offset_t r = this->rankOfRef[m - this->rangeBegin];
+
+          //Hash is already in the window
+          if(this->refCount[r]++ > 0)
+            return;
 
-          //if hash doesn't exist in the map, add to it
-          if(slidingWindowMinhashes.find(hashVal) == slidingWindowMinhashes.end())
+          if(isQueryRank(r))
           {
-            slidingWindowMinhashes[hashVal] = slidingMapContainerValueType{this->NAPos, m->wpos};   //add the hash to window
-            status = IN::UNIQ;
+            //Coupled with a query minimizer
+            if(r <= this->pivot)
+              this->sharedSketchElements += 1;
           }
           else
           {
-            status = (slidingWindowMinhashes[hashVal].wposR == NAPos) ? IN::CPLD 
-              : IN::REV;
+            setBit(this->presentRanks, r);
 
-            //if hash already exists in the map, just revise it
-            slidingWindowMinhashes[hashVal].wposR = m->wpos;
-          }
+            //Pivot needs to be decremented
+            if(r < this->pivot)
+            {
+              if(isSharedRank(this->pivot))
+                this->sharedSketchElements -= 1;
 
-          updateCountersAfterInsert(status, m);
+              this->pivot = prevPresentRank(this->pivot);
+            }
+          }
 
           assert(this->sharedSketchElements >= 0);
-          assert(this->sharedSketchElements <= Q.sketchSize);
         }
 
         /**
-         * @brief               delete a minimizer from the reference sequence from the map
+         * @brief               delete a minimizer from the reference sequence from the window
          * @param[in]   m       reference minimizer to remove
          */
         inline void delete_ref(MIIter_t m)
         {
-          hash_t hashVal = m->hash;
-          int status;
-          bool pivotDeleteCase = false;
-          
-          assert(this->slidingWindowMinhashes.find(hashVal) != this->slidingWindowMinhashes.end());
-
-          //This hashVal may exist with different wpos from 
-          //reference, do nothing in that case
-          
-          if(this->slidingWindowMinhashes[hashVal].wposR == m->wpos)
-          {
-            if(this->slidingWindowMinhashes[hashVal].wposQ == NAPos)
-            {
-              //Handle pivot deletion as a separate case
-              if(this->slidingWindowMinhashes.find(hashVal) == pivot)
-              {
-                pivot++;
+          offset_t r = this->rankOfRef[m - this->rangeBegin];
 
-                if( (this->pivot->second).wposQ != NAPos && (this->pivot->second).wposR != NAPos)
-                  this->sharedSketchElements += 1;
+          assert(this->refCount[r] > 0);
 
-                pivotDeleteCase = true;
-              }
+          //Same hash still occurs later in the window
+          if(--this->refCount[r] > 0)
+            return;
 
-              this->slidingWindowMinhashes.erase(hashVal);              //Remove the entry from the map
-              status = OUT::DEL; 
-            }
-            else
-            {
-              this->slidingWindowMinhashes[hashVal].wposR = NAPos;      //Just mark the reference hash absent
-              status = OUT::UPD; 
-            }
+          if(isQueryRank(r))
+          {
+            if(r <= this->pivot)
+              this->sharedSketchElements -= 1;
           }
           else
           {
-            status = OUT::NOOP;
-          }
+            clearBit(this->presentRanks, r);
 
-          if(!pivotDeleteCase) updateCountersAfterDelete(status, m);
+            //Pivot needs to be advanced, including when the pivot itself is deleted
+            if(r <= this->pivot)
+            {
+              this->pivot = nextPresentRank(this->pivot);
+
+              if(isSharedRank(this->pivot))
+                this->sharedSketchElements += 1;
+            }
+          }
 
           assert(this->sharedSketchElements >= 0);
-          assert(this->sharedSketchElements <= Q.sketchSize);
         }
 
         /**
-         * @brief               insert a range of minimizers from the reference sequence into the map
+         * @brief               insert a range of minimizers from the reference sequence into the window
          * @param[in]   begin   begin iterator
          * @param[in]   end     end iterator
          */
@@ -223,66 +205,56 @@ namespace skch
 
       private:
 
+        static inline void setBit(std::vector<uint64_t> &bits, offset_t r)
+        {
+          bits[r / 64] |= 1ULL << (r % 64);
+        }
+
+        static inline void clearBit(std::vector<uint64_t> &bits, offset_t r)
+        {
+          bits[r / 64] &= ~(1ULL << (r % 64));
+        }
+
+        inline bool isQueryRank(offset_t r) const
+        {
+          return (this->queryRanks[r / 64] >> (r % 64)) & 1;
+        }
+
+        inline bool isSharedRank(offset_t r) const
+        {
+          return isQueryRank(r) && this->refCount[r] > 0;
+        }
+
         /**
-         * @brief             logic to update internal counters after insert to map
-         * @param[in] status  insert status
-         * @param[in] m       reference minimizer that was inserted
+         * @brief       smallest present rank above r
+         * @details     always exists when called, as all query ranks are present and
+         *              fewer than 's' present ranks are at or below the pivot
          */
-        inline void updateCountersAfterInsert(int status, MIIter_t m)
+        inline offset_t nextPresentRank(offset_t r) const
         {
-          //Revise internal counters
-          if(m->hash <= this->pivot->first)
-          {
-            if(status == IN::CPLD)
-            {
-              //Increase count of shared sketch elements by 1
-              this->sharedSketchElements += 1;
-            }
-            else if(status == IN::UNIQ)
-            {
-              //Pivot needs to be decremented
-              if( (this->pivot->second).wposQ != NAPos && (this->pivot->second).wposR != NAPos)
-                this->sharedSketchElements -= 1;
+          offset_t word = r / 64;
+          uint64_t bits = this->presentRanks[word] & (~1ULL << (r % 64));
 
-              std::advance(this->pivot, -1);
-            }
-            else if(status == IN::REV)
-            {
-              //Do nothing
-            }
-          }
+          while(bits == 0)
+            bits = this->presentRanks[++word];
+
+          return word * 64 + __builtin_ctzll(bits);
         }
 
         /**
-         * @brief             logic to update internal counters after delete to map
-         * @param[in] status  insert status
-         * @param[in] m       reference minimizer that was inserted
+         * @brief       largest present rank below r
+         * @details     always exists when called, as a new present rank was just added below r
          */
-        inline void updateCountersAfterDelete(int status, MIIter_t m)
+        inline offset_t prevPresentRank(offset_t r) const
         {
-          //Revise internal counters
-          if(m->hash <= this->pivot->first)
-          {
-            if(status == OUT::UPD)
-            {
-              //Decrease count of shared sketch elements by 1
-              this->sharedSketchElements -= 1;
-            }
-            else if(status == OUT::DEL)
-            {
-              //Pivot needs to be advanced
-              std::advance(this->pivot, 1);
+          offset_t word = r / 64;
+          uint64_t bits = this->presentRanks[word] & ((1ULL << (r % 64)) - 1);
 
-              if( (this->pivot->second).wposQ != NAPos && (this->pivot->second).wposR != NAPos)
-                this->sharedSketchElements += 1;
-            }
-            else if(status == OUT::NOOP)
-            {
-              //Do nothing
-            }
-          }
-        }
+          while(bits == 0)
+            bits = this->presentRanks[--word];
 
+          return word * 64 + 63 - __builtin_clzll(bits);
+        }
     };
 }
 
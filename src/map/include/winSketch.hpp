@@ -9,7 +9,6 @@
 
 #include <vector>
 #include <algorithm>
-#include <unordered_map>
 #include <map>
 #include <cassert>
 #include <zlib.h>  
@@ -19,14 +18,13 @@
 #include "map/include/commonFunc.hpp"
 #include "map/include/base_types.hpp"
 #include "map/include/map_parameters.hpp"
+#include "map/include/genomeReader.hpp"
 
 //External includes
 #include "common/kseq.h"
 #include "common/murmur3.h"
 #include "common/prettyprint.hpp"
 
-KSEQ_INIT(gzFile, gzread)
-
 namespace skch
 {
   /**
@@ -34,12 +32,13 @@ namespace skch
    * @brief     sketches and indexes the reference (subject sequence)
    * @details  
    *            1.  Minimizers are computed in streaming fashion
-   *                Computing minimizers is using double ended queue which gives
+   *                Computing minimizers is using sliding window minimum (ring buffer) which gives
    *                O(reference size) complexity
    *                Algorithm described here:
    *                https://people.cs.uct.ac.za/~ksmith/articles/sliding_window_minimum.html
    *
-   *            2.  Index hashes into appropriate format to enable fast search at L1 mapping stage
+   *            2.  Index hashes into appropriate format to enable fast search at L1 mapping stage,
+   *                sorted unique hashes with positions in compressed sparse row format
    */
     class Sketch
     {
@@ -54,13 +53,45 @@ namespace skch
       //Minimizers that occur this or more times will be ignored (computed based on percentageThreshold)
       int freqThreshold = std::numeric_limits<int>::max();
 
+      //Count of minimizers looked up ahead of the current one by appendHits()
+      const int64_t lookupPrefetchDistance = 16;
+
       //Make the default constructor private, non-accessible
       Sketch();
 
       public:
 
       typedef std::vector< MinimizerInfo > MI_Type;
-      using MIIter_t = MI_Type::const_iterator;
+      using MIIter_t = const MinimizerInfo *;
+
+      //Range of reference positions of a minimizer, [first, second)
+      typedef std::pair< const MinimizerMetaData *, const MinimizerMetaData * > MI_Range_t;
+
+      /**
+       * Flat, position independent layout of a sketch (see save()), suitable for 
+       * memory-mapping and querying in place. All arrays are 64-byte aligned, 
+       * positions are byte offsets relative to the beginning of the layout
+       */
+      struct FlatLayout
+      {
+        uint64_t contigCount;
+        uint64_t genomeCount;
+        uint64_t minimizerCount;
+        uint64_t keyCount;
+        uint64_t postingCount;
+        int64_t freqThreshold;
+        int64_t keyDirectoryShift;
+        uint64_t contigLengthsPos;          //offset_t [contigCount]
+        uint64_t contigNamesPos;            //uint64_t [contigCount], offsets of NUL terminated names in name blob
+        uint64_t nameBlobPos;               //char []
+        uint64_t sequencesByFilePos;        //seqno_t [genomeCount]
+        uint64_t genomeLengthsPos;          //uint64_t [genomeCount]
+        uint64_t minimizerIndexPos;         //MinimizerInfo [minimizerCount], same as minimizerIndex
+        uint64_t keysPos;                   //hash_t [keyCount], unique minimizer hashes in ascending order
+        uint64_t postingOffsetsPos;         //uint64_t [keyCount + 1], postings of keys[i] are [offsets[i], offsets[i+1])
+        uint64_t postingsPos;               //MinimizerMetaData [postingCount]
+        uint64_t keyDirectoryPos;           //uint32_t [2^(32 - keyDirectoryShift) + 1], same as keyDirectory
+      };
 
       //Keep sequence length, name that appear in the sequence (for printing the mappings later)
       std::vector< ContigInfo > metadata;
@@ -74,16 +105,38 @@ namespace skch
        */
       std::vector< seqno_t > sequencesByFileInfo;
 
-      //Index for fast seed lookup
+      //Length of each genome (file), counting only sequences of at least fragment length, 
+      //rounded down to a multiple of fragment length
+      std::vector< uint64_t > genomeLengths;
+
+      private:
+
+      //Index for fast seed lookup, in compressed sparse row format
       /*
-       * [minimizer #1] -> [pos1, pos2, pos3 ...]
-       * [minimizer #2] -> [pos1, pos2...]
-       * ...
+       * keys      [minimizer #1, minimizer #2, ...]  unique hashes in ascending order
+       * offsets   [0, 3, 5, ...]
+       * postings  [pos1, pos2, pos3, pos1, pos2, ...] positions of keys[i] are 
+       *           postings[offsets[i] .. offsets[i+1]-1], ordered as they appear in the reference
+       * Arrays are owned by the sketch, or memory-mapped
        */
-      using MI_Map_t = std::unordered_map< MinimizerMapKeyType, MinimizerMapValueType >;
-      MI_Map_t minimizerPosLookupIndex;
+      std::vector< MinimizerMapKeyType > lookupKeys;
+      std::vector< uint64_t > lookupOffsets;
+      std::vector< MinimizerMetaData > lookupPostings;
 
-      private:
+      const MinimizerMapKeyType *keys = nullptr;
+      const uint64_t *postingOffsets = nullptr;
+      const MinimizerMetaData *postings = nullptr;
+      uint64_t keyCount = 0;
+
+      /*
+       * Directory over leading bits of the keys, keys with leading bits d are 
+       * keys[keyDirectory[d] .. keyDirectory[d+1]-1]
+       * Narrows down the binary search of a key to a few cache lines
+       * Owned by the sketch, or memory-mapped along with the above arrays
+       */
+      std::vector< uint32_t > lookupDirectory;
+      const uint32_t *keyDirectory = nullptr;
+      int keyDirectoryShift = 0;
 
       /**
        * Keep list of minimizers, sequence# , their position within seq , here while parsing sequence 
@@ -96,28 +149,72 @@ namespace skch
       //[... ,x -> y, ...] implies y number of minimizers occur x times
       std::map<int, int> minimizerFreqHistogram;
 
+      //Memory-mapped flat layout, used instead of the above containers when not null
+      const char *flatBase = nullptr;
+      const FlatLayout *flat = nullptr;
+
       public:
 
       /**
        * @brief   constructor
        *          also builds, indexes the minimizer table
+       * @param[in] reader        optional reader of genomes ahead of time
+       * @param[in] readerBegin   index of the first reference genome of p.refSequences
+       *                          in the file list of the reader
        */
-      Sketch(const skch::Parameters &p) 
+      Sketch(const skch::Parameters &p, GenomeReader *reader = nullptr, uint64_t readerBegin = 0) 
         :
           param(p) {
-            this->build();
+            this->build(reader, readerBegin);
             this->index();
             this->computeFreqHist();
           }
 
+      //Lookup index points into owned arrays, which stay in place when moved but not when copied
+      Sketch(const Sketch &) = delete;
+      Sketch(Sketch &&) = default;
+
+      /**
+       * @brief   constructor
+       *          uses a sketch previously written by save() in place, e.g. from a 
+       *          memory-mapped reference index, instead of parsing and indexing 
+       *          the reference sequences. Lookup tables are not copied
+       * @param[in] base    beginning of the flat layout, must outlive the sketch,
+       *                    checked beforehand with checkFlatLayout()
+       */
+      Sketch(const skch::Parameters &p, const char *base) 
+        :
+          param(p),
+          flatBase(base),
+          flat(reinterpret_cast<const FlatLayout *>(base)) {
+            this->freqThreshold = flat->freqThreshold;
+
+            //Per-genome tables are small, keep a copy
+            auto filesBegin = flatArray<seqno_t>(flat->sequencesByFilePos);
+            this->sequencesByFileInfo.assign(filesBegin, filesBegin + flat->genomeCount);
+
+            auto lengthsBegin = flatArray<uint64_t>(flat->genomeLengthsPos);
+            this->genomeLengths.assign(lengthsBegin, lengthsBegin + flat->genomeCount);
+
+            this->keys = flatArray<MinimizerMapKeyType>(flat->keysPos);
+            this->postingOffsets = flatArray<uint64_t>(flat->postingOffsetsPos);
+            this->postings = flatArray<MinimizerMetaData>(flat->postingsPos);
+            this->keyCount = flat->keyCount;
+
+            this->keyDirectory = flatArray<uint32_t>(flat->keyDirectoryPos);
+            this->keyDirectoryShift = flat->keyDirectoryShift;
+          }
+
       private:
 
       /**
        * @brief     build the sketch table
        * @details   compute and save minimizers from the reference sequence(s)
        *            assuming a fixed window size
+       * @param[in] reader        reader of genomes ahead of time, genomes are read here if null
+       * @param[in] readerBegin   index of the first reference genome in the file list of the reader
        */
-      void build()
+      void build(GenomeReader *reader, uint64_t readerBegin)
       {
 
         //sequence counter while parsing file
@@ -126,25 +223,38 @@ namespace skch
         if ( omp_get_thread_num() == 0)
           std::cerr << "INFO [thread 0], skch::Sketch::build, window size for minimizer sampling  = " << param.windowSize << std::endl;
 
-        for(const auto &fileName : param.refSequences)
+        for(uint64_t j = 0; j < param.refSequences.size(); j++)
         {
 
 #ifdef DEBUG
-        std::cerr << "INFO, skch::Sketch::build, building minimizer index for " << fileName << std::endl;
+        std::cerr << "INFO, skch::Sketch::build, building minimizer index for " << param.refSequences[j] << std::endl;
 #endif
 
-          //Open the file using kseq
-          gzFile fp = gzopen(fileName.c_str(), "r");
-          kseq_t *seq = kseq_init(fp);
+          std::unique_ptr<ParsedGenome> genome;
+
+          if(reader != nullptr)
+            genome = reader->take(readerBegin + j);
+          else
+          {
+            genome.reset(new ParsedGenome());
+            genome->read(param.refSequences[j]);
+          }
 
-          //size of sequence
-          offset_t len;
+          uint64_t genomeLen = 0;
 
-          while ((len = kseq_read(seq)) >= 0) 
+          for(auto &record : genome->records)
           {
+            SequenceRecord *seq = &record;
+
+            //size of sequence
+            offset_t len = seq->seq.l;
+
             //Save the sequence name
             metadata.push_back( ContigInfo{seq->name.s, (offset_t)seq->seq.l} );
 
+            if(len >= param.minReadLength)
+              genomeLen += ((uint64_t)len / param.minReadLength) * param.minReadLength;
+
             //Is the sequence too short?
             if(len < param.windowSize || len < param.kmerSize)
             {
@@ -154,16 +264,14 @@ namespace skch
             }
             else
             {
-              skch::CommonFunc::addMinimizers(this->minimizerIndex, seq, param.kmerSize, param.windowSize, param.alphabetSize, seqCounter);
+              skch::CommonFunc::addMinimizers(this->minimizerIndex, seq, param.kmerSize, param.windowSize, param.alphabetSize, param.rollingHash, seqCounter);
             }
 
             seqCounter++;
           }
 
           sequencesByFileInfo.push_back(seqCounter);
-
-          kseq_destroy(seq);  
-          gzclose(fp); //close the file handler 
+          genomeLengths.push_back(genomeLen);
         }
 
         if ( omp_get_thread_num() == 0)
@@ -176,16 +284,60 @@ namespace skch
        */
       void index()
       {
-        //Parse all the minimizers and push into the map
-        for(auto &e : minimizerIndex)
+        //Minimizers are already ordered by position, sorting by (hash, position)
+        //groups them by hash while keeping the positions of each hash in order
+        MI_Type minimizersByHash (minimizerIndex);
+        std::sort(minimizersByHash.begin(), minimizersByHash.end());
+
+        lookupPostings.reserve(minimizersByHash.size());
+
+        for(auto &e : minimizersByHash)
         {
-          // [hash value -> info about minimizer]
-          minimizerPosLookupIndex[e.hash].push_back( 
-              MinimizerMetaData{e.seqId, e.wpos});
+          if(lookupKeys.empty() || lookupKeys.back() != e.hash)
+          {
+            lookupKeys.push_back(e.hash);
+            lookupOffsets.push_back(lookupPostings.size());
+          }
+
+          lookupPostings.push_back( MinimizerMetaData{e.seqId, e.wpos} );
         }
 
+        lookupOffsets.push_back(lookupPostings.size());
+
+        this->keys = lookupKeys.data();
+        this->postingOffsets = lookupOffsets.data();
+        this->postings = lookupPostings.data();
+        this->keyCount = lookupKeys.size();
+
+        this->buildKeyDirectory();
+
         if ( omp_get_thread_num() == 0)
-          std::cerr << "INFO [thread 0], skch::Sketch::index, unique minimizers = " << minimizerPosLookupIndex.size() << std::endl;
+          std::cerr << "INFO [thread 0], skch::Sketch::index, unique minimizers = " << keyCount << std::endl;
+      }
+
+      /**
+       * @brief   build the directory over leading bits of the sorted keys,
+       *          about 4 keys per directory entry
+       */
+      void buildKeyDirectory()
+      {
+        int directoryBits = 0;
+        while(directoryBits < 24 && (4ULL << directoryBits) < keyCount)
+          directoryBits++;
+
+        keyDirectoryShift = 8 * sizeof(MinimizerMapKeyType) - directoryBits;
+        lookupDirectory.resize((1ULL << directoryBits) + 1);
+
+        uint64_t k = 0;
+        for(uint64_t d = 0; d < lookupDirectory.size(); d++)
+        {
+          while(k < keyCount && ((uint64_t) keys[k] >> keyDirectoryShift) < d)
+            k++;
+
+          lookupDirectory[d] = k;
+        }
+
+        this->keyDirectory = lookupDirectory.data();
       }
 
       /**
@@ -197,15 +349,15 @@ namespace skch
 
         //1. Compute histogram
 
-        for(auto &e : this->minimizerPosLookupIndex)
-          this->minimizerFreqHistogram[e.second.size()] += 1;
+        for(uint64_t i = 0; i < keyCount; i++)
+          this->minimizerFreqHistogram[postingOffsets[i+1] - postingOffsets[i]] += 1;
 
         if ( omp_get_thread_num() == 0)
           std::cerr << "INFO [thread 0], skch::Sketch::computeFreqHist, Frequency histogram of minimizers = " <<  *this->minimizerFreqHistogram.begin() <<  " ... " << *this->minimizerFreqHistogram.rbegin() << std::endl;
 
         //2. Compute frequency threshold to ignore most frequent minimizers
 
-        int64_t totalUniqueMinimizers = this->minimizerPosLookupIndex.size();
+        int64_t totalUniqueMinimizers = keyCount;
         int64_t minimizerToIgnore = totalUniqueMinimizers * percentageThreshold / 100;
 
         int64_t sum = 0;
@@ -245,6 +397,227 @@ namespace skch
 
       public:
 
+      /**
+       * @brief     write the sketch to a binary stream in flat layout, 
+       *            to be used later with Sketch(const skch::Parameters &, const char *)
+       * @details   positions in the layout are relative to the current stream position,
+       *            which should be 64-byte aligned for aligned access to the arrays
+       */
+      void save(std::ostream &out) const
+      {
+        assert(this->flat == nullptr);
+
+        std::streamoff base = out.tellp();
+
+        FlatLayout layout = {};
+        layout.contigCount = metadata.size();
+        layout.genomeCount = sequencesByFileInfo.size();
+        layout.minimizerCount = minimizerIndex.size();
+        layout.keyCount = lookupKeys.size();
+        layout.postingCount = lookupPostings.size();
+        layout.freqThreshold = freqThreshold;
+        layout.keyDirectoryShift = keyDirectoryShift;
+
+        //Placeholder, revised after all arrays are written
+        CommonFunc::writePod(out, layout);
+
+        //Contig table
+        std::vector<offset_t> contigLengths;
+        std::vector<uint64_t> contigNames;
+        std::string nameBlob;
+
+        for(auto &e : metadata)
+        {
+          contigLengths.push_back(e.len);
+          contigNames.push_back(nameBlob.size());
+          nameBlob.append(e.name.c_str(), e.name.size() + 1);
+        }
+
+        layout.contigLengthsPos = writeFlatArray(out, base, contigLengths.data(), contigLengths.size());
+        layout.contigNamesPos = writeFlatArray(out, base, contigNames.data(), contigNames.size());
+        layout.nameBlobPos = writeFlatArray(out, base, nameBlob.data(), nameBlob.size());
+        layout.sequencesByFilePos = writeFlatArray(out, base, sequencesByFileInfo.data(), sequencesByFileInfo.size());
+        layout.genomeLengthsPos = writeFlatArray(out, base, genomeLengths.data(), genomeLengths.size());
+        layout.minimizerIndexPos = writeFlatArray(out, base, minimizerIndex.data(), minimizerIndex.size());
+
+        //Lookup index is saved as it is
+        layout.keysPos = writeFlatArray(out, base, lookupKeys.data(), lookupKeys.size());
+        layout.postingOffsetsPos = writeFlatArray(out, base, lookupOffsets.data(), lookupOffsets.size());
+        layout.postingsPos = writeFlatArray(out, base, lookupPostings.data(), lookupPostings.size());
+        layout.keyDirectoryPos = writeFlatArray(out, base, lookupDirectory.data(), lookupDirectory.size());
+
+        std::streamoff end = out.tellp();
+        out.seekp(base);
+        CommonFunc::writePod(out, layout);
+        out.seekp(end);
+      }
+
+      /**
+       * @brief               check that a flat layout fits in its buffer, before it is used in place
+       * @details             arrays are checked to be aligned and within bounds, along with the
+       *                      small per-contig and per-genome tables, the lookup index is not scanned
+       * @param[in]   base    beginning of the flat layout, 64-byte aligned
+       * @param[in]   size    count of bytes available from base
+       * @return              false if the layout is truncated or corrupt
+       */
+      static bool checkFlatLayout(const char *base, uint64_t size)
+      {
+        if (size < sizeof(FlatLayout))
+          return false;
+
+        const FlatLayout *layout = reinterpret_cast<const FlatLayout *>(base);
+
+        auto fits = [&](uint64_t pos, uint64_t count, uint64_t elementSize)
+        {
+          return pos % 64 == 0 && pos >= sizeof(FlatLayout) && pos <= size && count <= (size - pos) / elementSize;
+        };
+
+        if (!fits(layout->contigLengthsPos, layout->contigCount, sizeof(offset_t)) ||
+            !fits(layout->contigNamesPos, layout->contigCount, sizeof(uint64_t)) ||
+            !fits(layout->sequencesByFilePos, layout->genomeCount, sizeof(seqno_t)) ||
+            !fits(layout->genomeLengthsPos, layout->genomeCount, sizeof(uint64_t)) ||
+            !fits(layout->minimizerIndexPos, layout->minimizerCount, sizeof(MinimizerInfo)) ||
+            !fits(layout->keysPos, layout->keyCount, sizeof(MinimizerMapKeyType)) ||
+            !fits(layout->postingOffsetsPos, layout->keyCount + 1, sizeof(uint64_t)) ||
+            !fits(layout->postingsPos, layout->postingCount, sizeof(MinimizerMetaData)))
+          return false;
+
+        auto postingOffsets = reinterpret_cast<const uint64_t *>(base + layout->postingOffsetsPos);
+
+        if (postingOffsets[0] != 0 || postingOffsets[layout->keyCount] != layout->postingCount)
+          return false;
+
+        //Directory of at most 2^24 + 1 entries (see buildKeyDirectory()), covering all keys
+        int64_t keyBits = 8 * sizeof(MinimizerMapKeyType);
+        if (layout->keyDirectoryShift < keyBits - 24 || layout->keyDirectoryShift > keyBits)
+          return false;
+
+        uint64_t keyDirectoryCount = (1ULL << (keyBits - layout->keyDirectoryShift)) + 1;
+        if (!fits(layout->keyDirectoryPos, keyDirectoryCount, sizeof(uint32_t)))
+          return false;
+
+        auto keyDirectory = reinterpret_cast<const uint32_t *>(base + layout->keyDirectoryPos);
+        if (keyDirectory[0] != 0 || keyDirectory[keyDirectoryCount - 1] != layout->keyCount)
+          return false;
+
+        //Name blob is followed by the genome table, names are NUL terminated within it
+        if (layout->nameBlobPos < sizeof(FlatLayout) || layout->nameBlobPos > layout->sequencesByFilePos)
+          return false;
+
+        uint64_t nameBlobSize = layout->sequencesByFilePos - layout->nameBlobPos;
+        auto contigNames = reinterpret_cast<const uint64_t *>(base + layout->contigNamesPos);
+
+        if (layout->contigCount > 0 && (nameBlobSize == 0 || base[layout->sequencesByFilePos - 1] != '\0'))
+          return false;
+
+        for (uint64_t i = 0; i < layout->contigCount; i++)
+          if (contigNames[i] >= nameBlobSize)
+            return false;
+
+        //Contigs of each genome are a range of contig ids
+        auto sequencesByFile = reinterpret_cast<const seqno_t *>(base + layout->sequencesByFilePos);
+
+        for (uint64_t i = 0; i < layout->genomeCount; i++)
+          if (sequencesByFile[i] < (i > 0 ? sequencesByFile[i-1] : 0) || (uint64_t) sequencesByFile[i] > layout->contigCount)
+            return false;
+
+        return true;
+      }
+
+      /**
+       * @brief               look up reference positions of a minimizer hash
+       * @param[in]   hash
+       * @return              range of positions, empty if hash does not occur in the reference
+       */
+      MI_Range_t findHits(hash_t hash) const
+      {
+        uint64_t d = (uint64_t) hash >> keyDirectoryShift;
+
+        auto keysBegin = this->keys + keyDirectory[d];
+        auto keysEnd = this->keys + keyDirectory[d+1];
+        auto keyIter = std::lower_bound(keysBegin, keysEnd, hash);
+
+        if(keyIter == keysEnd || *keyIter != hash)
+          return MI_Range_t(nullptr, nullptr);
+
+        auto offsets = this->postingOffsets + (keyIter - this->keys);
+
+        return MI_Range_t(this->postings + offsets[0], this->postings + offsets[1]);
+      }
+
+      /**
+       * @brief               look up reference positions of all minimizers of a query,
+       *                      and append them to seedHits, ignoring high frequency minimizers
+       * @details             probes are software pipelined: directory entries and keys of 
+       *                      later minimizers are prefetched while the current one is searched,
+       *                      and postings are prefetched before they are copied
+       * @param[in]   queryBegin
+       * @param[in]   queryEnd
+       * @param[out]  seedRanges  buffer for ranges of positions, reused by the caller
+       * @param[out]  seedHits    positions of all the hits
+       */
+      template <typename Vec>
+        void appendHits(const MinimizerInfo *queryBegin, const MinimizerInfo *queryEnd, 
+            std::vector<MI_Range_t> &seedRanges, Vec &seedHits) const
+        {
+          const int64_t n = queryEnd - queryBegin;
+
+          auto bucket = [&](int64_t i) { return (uint64_t) queryBegin[i].hash >> keyDirectoryShift; };
+
+          seedRanges.clear();
+
+          //Directory entries of the first probes
+          for(int64_t i = 0; i < std::min(n, lookupPrefetchDistance); i++)
+            __builtin_prefetch(&keyDirectory[bucket(i)]);
+
+          for(int64_t i = 0; i < n; i++)
+          {
+            if(i + lookupPrefetchDistance < n)
+              __builtin_prefetch(&keyDirectory[bucket(i + lookupPrefetchDistance)]);
+
+            if(i + lookupPrefetchDistance/2 < n)
+              __builtin_prefetch(this->keys + keyDirectory[bucket(i + lookupPrefetchDistance/2)]);
+
+            MI_Range_t hitPositionList = findHits(queryBegin[i].hash);
+            auto hitCount = std::distance(hitPositionList.first, hitPositionList.second);
+
+            //Save the positions (Ignore high frequency hits)
+            if(hitCount > 0 && hitCount < this->freqThreshold)
+            {
+              __builtin_prefetch(hitPositionList.first);
+              seedRanges.push_back(hitPositionList);
+            }
+          }
+
+          for(auto &e : seedRanges)
+            seedHits.insert(seedHits.end(), e.first, e.second);
+        }
+
+      /**
+       * @brief     count of reference sequences (contigs)
+       */
+      seqno_t getContigCount() const
+      {
+        return this->flat == nullptr ? this->metadata.size() : this->flat->contigCount;
+      }
+
+      /**
+       * @brief     length of a reference sequence (contig)
+       */
+      offset_t getContigLength(seqno_t seqId) const
+      {
+        return this->flat == nullptr ? this->metadata[seqId].len : flatArray<offset_t>(flat->contigLengthsPos)[seqId];
+      }
+
+      /**
+       * @brief     name of a reference sequence (contig)
+       */
+      const char * getContigName(seqno_t seqId) const
+      {
+        return this->flat == nullptr ? this->metadata[seqId].name.c_str() 
+          : flatArray<char>(flat->nameBlobPos) + flatArray<uint64_t>(flat->contigNamesPos)[seqId];
+      }
+
       /**
        * @brief               search hash associated with given position inside the index
        * @details             if MIIter_t iter is returned, than *iter's wpos >= winpos
@@ -260,17 +633,26 @@ namespace skch
          * std::lower_bound --  Returns an iterator pointing to the first element in the range
          *                      that is not less than (i.e. greater or equal to) value.
          */
-        MIIter_t iter = std::lower_bound(this->minimizerIndex.begin(), this->minimizerIndex.end(), searchPosInfo, cmp);
+        MIIter_t iter = std::lower_bound(this->getMinimizerIndexBegin(), this->getMinimizerIndexEnd(), searchPosInfo, cmp);
 
         return iter;
       }
 
+      /**
+       * @brief     Return begin iterator on minimizerIndex
+       */
+      MIIter_t getMinimizerIndexBegin() const
+      {
+        return this->flat == nullptr ? this->minimizerIndex.data() : flatArray<MinimizerInfo>(flat->minimizerIndexPos);
+      }
+
       /**
        * @brief     Return end iterator on minimizerIndex
        */
       MIIter_t getMinimizerIndexEnd() const
       {
-        return this->minimizerIndex.end();
+        return this->flat == nullptr ? this->minimizerIndex.data() + this->minimizerIndex.size() 
+          : flatArray<MinimizerInfo>(flat->minimizerIndexPos) + flat->minimizerCount;
       }
 
       int getFreqThreshold() const
@@ -280,6 +662,33 @@ namespace skch
 
       private:
 
+      /**
+       * @brief     typed pointer to an array in the flat layout
+       */
+      template <typename T>
+        const T * flatArray(uint64_t pos) const
+        {
+          return reinterpret_cast<const T *>(this->flatBase + pos);
+        }
+
+      /**
+       * @brief     write an array of the flat layout, 64-byte aligned
+       * @return    position of the array relative to base
+       */
+      template <typename T>
+        static uint64_t writeFlatArray(std::ostream &out, std::streamoff base, const T *data, uint64_t size)
+        {
+          static const char padding[64] = {};
+
+          std::streamoff pos = out.tellp() - base;
+          std::streamoff paddingSize = (64 - pos % 64) % 64;
+
+          out.write(padding, paddingSize);
+          out.write(reinterpret_cast<const char *>(data), size * sizeof(T));
+
+          return pos + paddingSize;
+        }
+
       /**
        * @brief     functor for comparing minimizers by their position in minimizerIndex
        * @details   used for locating minimizers with the required positional information